@@ -0,0 +1,157 @@
+//===========================================================================//
+//
+// Purpose: registry of connected clients
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ClientRegistry.h"
+#include "eiface.h"
+#include "edict.h"
+#include "game/server/iplayerinfo.h"
+#include "steam/steamclientpublic.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+extern IVEngineServer* engine;
+extern IPlayerInfoManager* playerinfomanager;
+extern CGlobalVars* gpGlobals;
+
+CClientRegistry::CClientRegistry()
+{
+    memset(m_Clients, 0, sizeof(m_Clients));
+    m_nCount = 0;
+    memset(m_UserIdSlot, 0, sizeof(m_UserIdSlot));
+}
+
+void CClientRegistry::Seed()
+{
+    if (gpGlobals == NULL)
+        return;
+
+    for (int i = 1; i <= gpGlobals->maxClients; i++)
+    {
+        edict_t* entity = engine->PEntityOfEntIndex(i);
+        if (!entity || entity->IsFree())
+            continue;
+
+        int userid = engine->GetPlayerUserId(entity);
+        if (userid == -1)
+            continue;
+
+        IPlayerInfo* player = playerinfomanager != NULL ? playerinfomanager->GetPlayerInfo(entity) : NULL;
+        Update(entity, userid, engine->GetPlayerNetworkIDString(entity), player != NULL ? player->GetName() : NULL);
+        if (player != NULL && player->IsConnected())
+            SetActive(entity);
+    }
+}
+
+ClientInfo_t* CClientRegistry::Update(edict_t* pEdict, int userid, const char* networkId, const char* name)
+{
+    int index = engine->IndexOfEdict(pEdict);
+    if (index <= 0 || index > ABSOLUTE_PLAYER_LIMIT)
+        return NULL;
+
+    ClientInfo_t& client = m_Clients[index];
+    if (client.m_pEdict == NULL)
+    {
+        client.m_pEdict = pEdict;
+        client.m_iIndex = index;
+        client.m_iUserId = -1;
+        client.m_bActive = false;
+        m_Indices[m_nCount++] = index;
+    }
+
+    if (client.m_iUserId != userid)
+    {
+        // The edict has been reused without a ClientDisconnect, eg. across
+        // a level change, so everything known about it is stale
+        if (client.m_iUserId != -1 && m_UserIdSlot[client.m_iUserId & 0xFFFF] == index)
+            m_UserIdSlot[client.m_iUserId & 0xFFFF] = 0;
+        client.m_iUserId = userid;
+        client.m_ulSteamId = 0;
+        client.m_szNetworkId[0] = '\0';
+        client.m_szName[0] = '\0';
+        client.m_bActive = false;
+        m_UserIdSlot[userid & 0xFFFF] = (unsigned char)index;
+    }
+
+    if (networkId != NULL)
+    {
+        Q_strncpy(client.m_szNetworkId, networkId, sizeof(client.m_szNetworkId));
+        client.m_ulSteamId = SteamIDFromNetworkID(networkId);
+    }
+    if (name != NULL)
+        Q_strncpy(client.m_szName, name, sizeof(client.m_szName));
+    return &client;
+}
+
+void CClientRegistry::SetActive(edict_t* pEdict)
+{
+    int index = engine->IndexOfEdict(pEdict);
+    if (index > 0 && index <= ABSOLUTE_PLAYER_LIMIT && m_Clients[index].m_pEdict != NULL)
+        m_Clients[index].m_bActive = true;
+}
+
+void CClientRegistry::Remove(edict_t* pEdict)
+{
+    int index = engine->IndexOfEdict(pEdict);
+    if (index <= 0 || index > ABSOLUTE_PLAYER_LIMIT || m_Clients[index].m_pEdict == NULL)
+        return;
+
+    ClientInfo_t& client = m_Clients[index];
+    if (m_UserIdSlot[client.m_iUserId & 0xFFFF] == index)
+        m_UserIdSlot[client.m_iUserId & 0xFFFF] = 0;
+    client.m_pEdict = NULL;
+
+    for (int i = 0; i < m_nCount; i++)
+    {
+        if (m_Indices[i] == index)
+        {
+            m_Indices[i] = m_Indices[--m_nCount];
+            break;
+        }
+    }
+}
+
+ClientInfo_t* CClientRegistry::Validate(const char* name, const char* networkId)
+{
+    // NetworkIDValidated only gives the name, which isn't necessarily unique,
+    // so the first client by that name still waiting for validation is taken
+    for (int i = 0; i < m_nCount; i++)
+    {
+        ClientInfo_t& client = m_Clients[m_Indices[i]];
+        if (client.m_ulSteamId == 0 && Q_strcmp(client.m_szName, name) == 0)
+        {
+            Q_strncpy(client.m_szNetworkId, networkId, sizeof(client.m_szNetworkId));
+            client.m_ulSteamId = SteamIDFromNetworkID(networkId);
+            return &client;
+        }
+    }
+    return NULL;
+}
+
+ClientInfo_t* CClientRegistry::FindByUserId(int userid)
+{
+    int index = m_UserIdSlot[userid & 0xFFFF];
+    if (index == 0 || m_Clients[index].m_pEdict == NULL || m_Clients[index].m_iUserId != userid)
+        return NULL;
+    return &m_Clients[index];
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: converts a "STEAM_X:Y:Z" network id to a 64-bit SteamID, or returns 0
+//          for bots, LAN players and players Steam hasn't validated yet
+//---------------------------------------------------------------------------------
+uint64 CClientRegistry::SteamIDFromNetworkID(const char* networkId)
+{
+    unsigned int universe, authServer, accountNumber;
+    if (networkId == NULL || sscanf(networkId, "STEAM_%u:%u:%u", &universe, &authServer, &accountNumber) != 3 || authServer > 1)
+        return 0;
+
+    CSteamID steamId(accountNumber * 2 + authServer, k_EUniversePublic, k_EAccountTypeIndividual);
+    return steamId.ConvertToUint64();
+}
@@ -0,0 +1,69 @@
+//===========================================================================//
+//
+// Purpose: the clients connected to the server, kept up to date from the
+//          plugin's client callbacks so that listing them or finding one by
+//          userid doesn't have to walk the edicts or call into the engine.
+//
+//          Only the game thread uses this.
+//
+//===========================================================================//
+
+#ifndef CLIENTREGISTRY_H
+#define CLIENTREGISTRY_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "const.h"
+#include "tier0/platform.h"
+
+struct edict_t;
+
+struct ClientInfo_t
+{
+    edict_t* m_pEdict;
+    int m_iIndex;                           // edict index
+    int m_iUserId;
+    uint64 m_ulSteamId;                     // 0 until Steam has validated the client, and for bots
+    char m_szNetworkId[MAX_NETWORKID_LENGTH];
+    char m_szName[MAX_PLAYER_NAME_LENGTH];
+    bool m_bActive;                         // spawned in, ClientActive has been called
+};
+
+class CClientRegistry
+{
+public:
+    CClientRegistry();
+
+    // Fills the registry from the edicts, for when the plugin is loaded while
+    // clients are already connected.
+    void Seed();
+
+    // Adds a client, or updates the one already using pEdict.  NULL
+    // networkId or name leave what is known alone.
+    ClientInfo_t* Update(edict_t* pEdict, int userid, const char* networkId, const char* name);
+    void SetActive(edict_t* pEdict);
+    void Remove(edict_t* pEdict);
+
+    // Records the Steam ID of the unvalidated client called name
+    ClientInfo_t* Validate(const char* name, const char* networkId);
+
+    ClientInfo_t* FindByUserId(int userid);
+
+    // The connected clients, in no particular order
+    int GetCount() const { return m_nCount; }
+    ClientInfo_t& Get(int i) { return m_Clients[m_Indices[i]]; }
+
+    // Converts a "STEAM_X:Y:Z" network id to a 64-bit SteamID, or returns 0
+    static uint64 SteamIDFromNetworkID(const char* networkId);
+
+private:
+    ClientInfo_t m_Clients[ABSOLUTE_PLAYER_LIMIT + 1];     // by edict index
+    int m_Indices[ABSOLUTE_PLAYER_LIMIT];
+    int m_nCount;
+
+    // Edict index for each userid, or 0.  Userids are networked as shorts.
+    unsigned char m_UserIdSlot[0x10000];
+};
+
+#endif // CLIENTREGISTRY_H
@@ -0,0 +1,114 @@
+//===========================================================================//
+//
+// Purpose: arenas for captured event records
+//
+//===========================================================================//
+
+#include <stdlib.h>
+
+#include "EventArena.h"
+#include "tier0/dbg.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Bytes per arena.  Records are a few hundred bytes, so an arena holds a few
+// batches' worth and the queue's worth of arenas is allocated as it grows.
+#define EVENT_ARENA_SIZE (256 * 1024)
+
+// Every allocation is preceded by the Arena_t it came from, or NULL if it came
+// from the heap.  Eight bytes keep the allocation itself 8-byte aligned.
+#define EVENT_ARENA_HEADER_SIZE 8
+
+#ifdef _DEBUG
+CInterlockedInt g_nCaptureHeapAllocs;
+#endif
+
+CEventArenas::CEventArenas()
+{
+    m_pCurrent = NULL;
+}
+
+CEventArenas::~CEventArenas()
+{
+    for (int i = 0; i < m_Arenas.Count(); i++)
+    {
+        Assert(m_Arenas[i]->m_nRefs == (m_Arenas[i] == m_pCurrent ? 1 : 0));
+        m_Arenas[i]->m_Stack.Term();
+    }
+    m_Arenas.PurgeAndDeleteElements();
+}
+
+void* CEventArenas::Alloc(int bytes)
+{
+    unsigned total = bytes + EVENT_ARENA_HEADER_SIZE;
+    if (total > EVENT_ARENA_SIZE)
+    {
+        CAPTURE_HEAP_ALLOC();
+        return AllocHeap(bytes);
+    }
+
+    void* p = m_pCurrent != NULL ? m_pCurrent->m_Stack.Alloc(total) : NULL;
+    if (p == NULL)
+    {
+        // The current arena is full.  It goes back to the free list once its
+        // last record is freed, which may already have happened.
+        if (m_pCurrent != NULL)
+            Release(m_pCurrent);
+
+        if (!m_FreeArenas.PopItem(&m_pCurrent))
+        {
+            CAPTURE_HEAP_ALLOC();
+            m_pCurrent = new Arena_t;
+            m_pCurrent->m_pOwner = this;
+            if (!m_pCurrent->m_Stack.Init(EVENT_ARENA_SIZE, 0, 0, EVENT_ARENA_HEADER_SIZE))
+            {
+                delete m_pCurrent;
+                m_pCurrent = NULL;
+                return AllocHeap(bytes);
+            }
+            m_Arenas.AddToTail(m_pCurrent);
+        }
+        m_pCurrent->m_nRefs = 1;
+
+        p = m_pCurrent->m_Stack.Alloc(total);
+        if (p == NULL)
+        {
+            CAPTURE_HEAP_ALLOC();
+            return AllocHeap(bytes);
+        }
+    }
+
+    ++m_pCurrent->m_nRefs;
+    *(Arena_t**)p = m_pCurrent;
+    return (char*)p + EVENT_ARENA_HEADER_SIZE;
+}
+
+void* CEventArenas::AllocHeap(int bytes)
+{
+    void* p = malloc(bytes + EVENT_ARENA_HEADER_SIZE);
+    *(Arena_t**)p = NULL;
+    return (char*)p + EVENT_ARENA_HEADER_SIZE;
+}
+
+void CEventArenas::Free(void* p)
+{
+    if (p == NULL)
+        return;
+
+    void* pBase = (char*)p - EVENT_ARENA_HEADER_SIZE;
+    Arena_t* pArena = *(Arena_t**)pBase;
+    if (pArena == NULL)
+        free(pBase);
+    else
+        Release(pArena);
+}
+
+void CEventArenas::Release(Arena_t* pArena)
+{
+    if (--pArena->m_nRefs == 0)
+    {
+        pArena->m_Stack.FreeAll(false);
+        pArena->m_pOwner->m_FreeArenas.PushItem(pArena);
+    }
+}
@@ -0,0 +1,71 @@
+//===========================================================================//
+//
+// Purpose: the memory captured event records are carved from.  Records are
+//          allocated one after another from a CMemoryStack arena on the game
+//          thread and freed on the writer thread once the batch holding them
+//          has been written or spooled.  Nothing is freed individually: an
+//          arena is recycled wholesale once it is full and every record in it
+//          has been freed, so in steady state capturing an event doesn't touch
+//          the general heap.
+//
+//===========================================================================//
+
+#ifndef EVENTARENA_H
+#define EVENTARENA_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier0/tslist.h"
+#include "tier0/memalloc.h"
+#include "tier1/memstack.h"
+#include "utlvector.h"
+
+// Marks a heap allocation made while capturing an event.  The allocation is
+// credited to "EventLogger capture" in the debug heap's stats, and debug
+// builds count it, so that CEventWriter can assert that logging an event
+// doesn't allocate once the arenas and pools have grown to fit the queue.
+#ifdef _DEBUG
+extern CInterlockedInt g_nCaptureHeapAllocs;
+#define CAPTURE_HEAP_ALLOC() MEM_ALLOC_CREDIT_("EventLogger capture"); ++g_nCaptureHeapAllocs
+#else
+#define CAPTURE_HEAP_ALLOC() MEM_ALLOC_CREDIT_("EventLogger capture")
+#endif
+
+class CEventArenas
+{
+public:
+    CEventArenas();
+
+    // Every allocation must have been freed by now
+    ~CEventArenas();
+
+    // Game thread only.  Allocations are 8-byte aligned.  Only allocates from
+    // the heap to add an arena, or for the odd record too big for one.
+    void* Alloc(int bytes);
+
+    // For records that aren't captured, eg. ones read back from the spool
+    static void* AllocHeap(int bytes);
+
+    // Frees memory from either Alloc or AllocHeap, from any thread
+    static void Free(void* p);
+
+    int GetArenaCount() const { return m_Arenas.Count(); }
+
+private:
+    struct Arena_t
+    {
+        CMemoryStack m_Stack;
+        CInterlockedInt m_nRefs;        // live allocations, plus one while it is being allocated from
+        CEventArenas* m_pOwner;
+    };
+
+    static void Release(Arena_t* pArena);
+
+    Arena_t* m_pCurrent;
+    CTSQueue<Arena_t*> m_FreeArenas;
+    CUtlVector<Arena_t*> m_Arenas;
+};
+
+#endif // EVENTARENA_H
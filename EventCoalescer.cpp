@@ -0,0 +1,423 @@
+//===========================================================================//
+//
+// Purpose: coalescing of bursty events
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "EventCoalescer.h"
+#include "EventArena.h"
+#include "EventFilter.h"
+#include "EventWriter.h"
+#include "tier0/platform.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static const EventRecordKey_t* FindKey(const CEventRecordBuilder& event, HKeySymbol symbol)
+{
+    for (int i = 0; i < event.GetKeyCount(); i++)
+    {
+        if (event.GetKey(i).m_Symbol == symbol)
+            return &event.GetKey(i);
+    }
+    return NULL;
+}
+
+static bool IsNumeric(KeyValues::types_t type)
+{
+    return type == KeyValues::TYPE_INT || type == KeyValues::TYPE_FLOAT;
+}
+
+static double NumericValue(const EventRecordKey_t& key)
+{
+    return key.m_Type == KeyValues::TYPE_INT ? key.m_iValue : key.m_flValue;
+}
+
+// coalesced_count and coalesced_ms
+#define COALESCED_SUMMARY_KEYS 2
+
+#define COALESCE_SLOTS (EVENT_COALESCE_MAX_GROUPS * 2)
+
+static unsigned SlotHash(unsigned hash)
+{
+    return (hash * 2654435761u >> 16) & (COALESCE_SLOTS - 1);
+}
+
+CEventCoalescer::CEventCoalescer()
+{
+    memset(m_Slots, 0, sizeof(m_Slots));
+    m_bWarnedKeys = false;
+    m_bWarnedStrings = false;
+    m_bWarnedGroups = false;
+}
+
+CEventCoalescer::~CEventCoalescer()
+{
+    m_Groups.PurgeAndDeleteElements();
+    m_FreeGroups.PurgeAndDeleteElements();
+}
+
+unsigned CEventCoalescer::GroupHash(const CEventRecordBuilder& event, const EventFilterRule_t& rule)
+{
+    // FNV-1a over the event and the values of its coalesce_by keys
+    unsigned hash = 2166136261u ^ (unsigned)rule.m_Event;
+    for (int i = 0; i < rule.m_CoalesceBy.Count(); i++)
+    {
+        const EventRecordKey_t* pKey = FindKey(event, rule.m_CoalesceBy[i]);
+        if (pKey == NULL)
+        {
+            hash = (hash ^ 0xffffffffu) * 16777619u;
+            continue;
+        }
+
+        const unsigned char* p;
+        int len;
+        switch (pKey->m_Type)
+        {
+        case KeyValues::TYPE_STRING:
+            p = (const unsigned char*)pKey->m_pszValue;
+            len = pKey->m_nLength;
+            break;
+        case KeyValues::TYPE_UINT64:
+            p = (const unsigned char*)&pKey->m_ulValue;
+            len = sizeof(pKey->m_ulValue);
+            break;
+        default:
+            p = (const unsigned char*)&pKey->m_iValue;
+            len = sizeof(pKey->m_iValue);
+            break;
+        }
+        for (int j = 0; j < len; j++)
+            hash = (hash ^ p[j]) * 16777619u;
+    }
+    return hash;
+}
+
+bool CEventCoalescer::ContainsKey(const CUtlVector<HKeySymbol>& keys, HKeySymbol symbol)
+{
+    for (int i = 0; i < keys.Count(); i++)
+    {
+        if (keys[i] == symbol)
+            return true;
+    }
+    return false;
+}
+
+bool CEventCoalescer::Matches(const Group_t* pGroup, const CEventRecordBuilder& event)
+{
+    int nGroupKeys = 0;
+    for (int i = 0; i < pGroup->m_nKeys; i++)
+    {
+        const CoalescedKey_t& key = pGroup->m_Keys[i];
+        if (!key.m_bGroup)
+            continue;
+
+        nGroupKeys++;
+        const EventRecordKey_t* pKey = FindKey(event, key.m_Symbol);
+        if (pKey == NULL || pKey->m_Type != key.m_Type)
+            return false;
+
+        switch (key.m_Type)
+        {
+        case KeyValues::TYPE_STRING:
+            if (strcmp(pKey->m_pszValue, key.m_pszValue) != 0)
+                return false;
+            break;
+        case KeyValues::TYPE_UINT64:
+            if (pKey->m_ulValue != key.m_ulValue)
+                return false;
+            break;
+        default:
+            if (pKey->m_iValue != key.m_iValue)
+                return false;
+            break;
+        }
+    }
+
+    // The event mustn't have coalesce_by keys the group doesn't
+    const EventFilterRule_t& rule = *pGroup->m_pRule;
+    int nEventKeys = 0;
+    for (int i = 0; i < rule.m_CoalesceBy.Count(); i++)
+    {
+        if (FindKey(event, rule.m_CoalesceBy[i]) != NULL)
+            nEventKeys++;
+    }
+    return nEventKeys == nGroupKeys;
+}
+
+void CEventCoalescer::Add(const CEventRecordBuilder& event, const EventFilterRule_t& rule, CEventWriter& writer)
+{
+    unsigned hash = GroupHash(event, rule);
+    unsigned slot = SlotHash(hash);
+    for (; m_Slots[slot] != NULL; slot = (slot + 1) & (COALESCE_SLOTS - 1))
+    {
+        Group_t* pGroup = m_Slots[slot];
+        if (pGroup->m_pRule == &rule && pGroup->m_Hash == hash && Matches(pGroup, event))
+        {
+            Accumulate(pGroup, event);
+            return;
+        }
+    }
+
+    if (m_Groups.Count() >= EVENT_COALESCE_MAX_GROUPS)
+    {
+        if (!m_bWarnedGroups)
+        {
+            Warning("More than %d groups of events are being coalesced at once; writing the oldest before their window is over\n", EVENT_COALESCE_MAX_GROUPS);
+            m_bWarnedGroups = true;
+        }
+        Write(m_Groups[0], writer);
+        Close(0);
+
+        // Closing may have moved groups into the free slot found above
+        slot = SlotHash(hash);
+        while (m_Slots[slot] != NULL)
+            slot = (slot + 1) & (COALESCE_SLOTS - 1);
+    }
+
+    Group_t* pGroup;
+    if (m_FreeGroups.Count() > 0)
+    {
+        pGroup = m_FreeGroups.Tail();
+        m_FreeGroups.Remove(m_FreeGroups.Count() - 1);
+    }
+    else
+    {
+        CAPTURE_HEAP_ALLOC();
+        pGroup = new Group_t;
+    }
+    pGroup->m_pRule = &rule;
+    pGroup->m_Hash = hash;
+    Start(pGroup, event);
+    m_Groups.AddToTail(pGroup);
+    m_Slots[slot] = pGroup;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: takes m_Groups[index], which has been written, out of the groups and
+//          the slots.  The groups probed past its slot are shifted back, so
+//          that lookups never need to step over a removed entry.
+//---------------------------------------------------------------------------------
+void CEventCoalescer::Close(int index)
+{
+    Group_t* pGroup = m_Groups[index];
+    m_Groups.Remove(index);
+    m_FreeGroups.AddToTail(pGroup);
+
+    unsigned hole = SlotHash(pGroup->m_Hash);
+    while (m_Slots[hole] != pGroup)
+        hole = (hole + 1) & (COALESCE_SLOTS - 1);
+
+    for (unsigned slot = (hole + 1) & (COALESCE_SLOTS - 1); m_Slots[slot] != NULL; slot = (slot + 1) & (COALESCE_SLOTS - 1))
+    {
+        // A group can fill the hole if its home slot isn't between the hole and where it is now
+        unsigned home = SlotHash(m_Slots[slot]->m_Hash);
+        if (((slot - home) & (COALESCE_SLOTS - 1)) >= ((slot - hole) & (COALESCE_SLOTS - 1)))
+        {
+            m_Slots[hole] = m_Slots[slot];
+            hole = slot;
+        }
+    }
+    m_Slots[hole] = NULL;
+}
+
+void CEventCoalescer::Start(Group_t* pGroup, const CEventRecordBuilder& event)
+{
+    pGroup->m_flStarted = Plat_FloatTime();
+    pGroup->m_Time = event.GetTime();
+    pGroup->m_iLastCurTime = event.GetTime().m_iCurTime;
+    pGroup->m_nCount = 1;
+    pGroup->m_nKeys = 0;
+    pGroup->m_nOutputKeys = COALESCED_SUMMARY_KEYS;
+    pGroup->m_nStringBytes = 0;
+
+    for (int i = 0; i < event.GetKeyCount(); i++)
+        AddKey(pGroup, event.GetKey(i));
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: adds a key to the group with src as its first value.  Returns NULL
+//          if the coalesced event has no room for it.
+//---------------------------------------------------------------------------------
+CEventCoalescer::CoalescedKey_t* CEventCoalescer::AddKey(Group_t* pGroup, const EventRecordKey_t& src)
+{
+    const EventFilterRule_t& rule = *pGroup->m_pRule;
+    bool bGroup = ContainsKey(rule.m_CoalesceBy, src.m_Symbol);
+    bool bSum = !bGroup && IsNumeric(src.m_Type) && ContainsKey(rule.m_CoalesceSum, src.m_Symbol);
+
+    int outputKeys = pGroup->m_nOutputKeys + (bSum ? 3 : 1);
+    if (outputKeys > EVENT_RECORD_MAX_KEYS)
+    {
+        if (!m_bWarnedKeys)
+        {
+            Warning("Coalesced %s events have more keys than the %d of EVENT_RECORD_MAX_KEYS; %s and any others that don't fit are left out\n",
+                KeyValuesSystem()->GetStringForSymbol(rule.m_Event), EVENT_RECORD_MAX_KEYS, KeyValuesSystem()->GetStringForSymbol(src.m_Symbol));
+            m_bWarnedKeys = true;
+        }
+        return NULL;
+    }
+    if (src.m_Type == KeyValues::TYPE_STRING && pGroup->m_nStringBytes + src.m_nLength + 1 > EVENT_COALESCE_MAX_STRINGS)
+    {
+        if (!m_bWarnedStrings)
+        {
+            Warning("Coalesced %s events have more string values than the %d bytes of EVENT_COALESCE_MAX_STRINGS; %s and any others that don't fit are left out\n",
+                KeyValuesSystem()->GetStringForSymbol(rule.m_Event), EVENT_COALESCE_MAX_STRINGS, KeyValuesSystem()->GetStringForSymbol(src.m_Symbol));
+            m_bWarnedStrings = true;
+        }
+        return NULL;
+    }
+
+    CoalescedKey_t* pKey = &pGroup->m_Keys[pGroup->m_nKeys++];
+    pGroup->m_nOutputKeys = outputKeys;
+    pKey->m_Symbol = src.m_Symbol;
+    pKey->m_Type = src.m_Type;
+    pKey->m_bGroup = bGroup;
+    pKey->m_bSum = bSum;
+
+    switch (src.m_Type)
+    {
+    case KeyValues::TYPE_STRING:
+        {
+            char* dest = pGroup->m_Strings + pGroup->m_nStringBytes;
+            memcpy(dest, src.m_pszValue, src.m_nLength + 1);
+            pGroup->m_nStringBytes += src.m_nLength + 1;
+            pKey->m_pszValue = dest;
+        }
+        break;
+    case KeyValues::TYPE_UINT64:
+        pKey->m_ulValue = src.m_ulValue;
+        break;
+    default:
+        pKey->m_iValue = src.m_iValue;
+        pKey->m_flSum = pKey->m_flMin = pKey->m_flMax = NumericValue(src);
+        break;
+    }
+    return pKey;
+}
+
+void CEventCoalescer::Accumulate(Group_t* pGroup, const CEventRecordBuilder& event)
+{
+    pGroup->m_nCount++;
+    pGroup->m_iLastCurTime = event.GetTime().m_iCurTime;
+
+    for (int i = 0; i < event.GetKeyCount(); i++)
+    {
+        const EventRecordKey_t& src = event.GetKey(i);
+
+        // Events of a kind usually have the same keys in the same order
+        CoalescedKey_t* pKey = NULL;
+        if (i < pGroup->m_nKeys && pGroup->m_Keys[i].m_Symbol == src.m_Symbol)
+        {
+            pKey = &pGroup->m_Keys[i];
+        }
+        else
+        {
+            for (int j = 0; j < pGroup->m_nKeys && pKey == NULL; j++)
+            {
+                if (pGroup->m_Keys[j].m_Symbol == src.m_Symbol)
+                    pKey = &pGroup->m_Keys[j];
+            }
+        }
+
+        // A key the first event didn't have starts out with this value
+        if (pKey == NULL)
+        {
+            AddKey(pGroup, src);
+            continue;
+        }
+
+        if (!pKey->m_bSum || pKey->m_Type != src.m_Type)
+            continue;
+        double value = NumericValue(src);
+        pKey->m_flSum += value;
+        if (value < pKey->m_flMin)
+            pKey->m_flMin = value;
+        if (value > pKey->m_flMax)
+            pKey->m_flMax = value;
+    }
+}
+
+void CEventCoalescer::Write(Group_t* pGroup, CEventWriter& writer)
+{
+    CEventRecordBuilder event(KeyValuesSystem()->GetStringForSymbol(pGroup->m_pRule->m_Event));
+    event.SetTime(pGroup->m_Time);
+    event.SetInt("coalesced_count", pGroup->m_nCount);
+    event.SetInt("coalesced_ms", pGroup->m_iLastCurTime - pGroup->m_Time.m_iCurTime);
+
+    char name[128];
+    for (int i = 0; i < pGroup->m_nKeys; i++)
+    {
+        const CoalescedKey_t& key = pGroup->m_Keys[i];
+        if (!key.m_bSum)
+        {
+            switch (key.m_Type)
+            {
+            case KeyValues::TYPE_STRING:
+                event.AddString(key.m_Symbol, key.m_pszValue);
+                break;
+            case KeyValues::TYPE_UINT64:
+                event.AddUint64(key.m_Symbol, key.m_ulValue);
+                break;
+            case KeyValues::TYPE_INT:
+                event.AddInt(key.m_Symbol, key.m_iValue);
+                break;
+            default:
+                event.AddFloat(key.m_Symbol, key.m_flValue);
+                break;
+            }
+            continue;
+        }
+
+        const char* pszKey = KeyValuesSystem()->GetStringForSymbol(key.m_Symbol);
+        if (key.m_Type == KeyValues::TYPE_INT)
+        {
+            Q_snprintf(name, sizeof(name), "%s_sum", pszKey);
+            event.SetInt(name, (int)key.m_flSum);
+            Q_snprintf(name, sizeof(name), "%s_min", pszKey);
+            event.SetInt(name, (int)key.m_flMin);
+            Q_snprintf(name, sizeof(name), "%s_max", pszKey);
+            event.SetInt(name, (int)key.m_flMax);
+        }
+        else
+        {
+            Q_snprintf(name, sizeof(name), "%s_sum", pszKey);
+            event.SetFloat(name, (float)key.m_flSum);
+            Q_snprintf(name, sizeof(name), "%s_min", pszKey);
+            event.SetFloat(name, (float)key.m_flMin);
+            Q_snprintf(name, sizeof(name), "%s_max", pszKey);
+            event.SetFloat(name, (float)key.m_flMax);
+        }
+    }
+    writer.QueueEvent(event);
+}
+
+void CEventCoalescer::FlushExpired(CEventWriter& writer)
+{
+    double now = Plat_FloatTime();
+    for (int i = 0; i < m_Groups.Count(); )
+    {
+        Group_t* pGroup = m_Groups[i];
+        if (now - pGroup->m_flStarted < pGroup->m_pRule->m_flCoalesceWindow)
+        {
+            i++;
+            continue;
+        }
+
+        Write(pGroup, writer);
+        Close(i);
+    }
+}
+
+void CEventCoalescer::Flush(CEventWriter& writer)
+{
+    for (int i = 0; i < m_Groups.Count(); i++)
+    {
+        Write(m_Groups[i], writer);
+        m_FreeGroups.AddToTail(m_Groups[i]);
+    }
+    m_Groups.RemoveAll();
+    memset(m_Slots, 0, sizeof(m_Slots));
+}
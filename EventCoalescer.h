@@ -0,0 +1,116 @@
+//===========================================================================//
+//
+// Purpose: coalesces bursts of an event, eg. player_hurt, as the event
+//          filter's "coalesce" rules say.  Events with the same name and the
+//          same values of the rule's "coalesce_by" keys are summed up over the
+//          rule's window, starting with the first of them, into one event:
+//
+//              - coalesced_count: how many events there were
+//              - coalesced_ms: game time between the first and the last
+//              - <key>_sum, <key>_min and <key>_max for the rule's
+//                "coalesce_sum" int and float keys
+//              - the coalesce_by keys, and the first value of any other key,
+//                such as the players' state added by enrichment
+//
+//          stamped with the first event's time.  Keys that would take the
+//          event past EVENT_RECORD_MAX_KEYS, or its strings past
+//          EVENT_COALESCE_MAX_STRINGS, are left out.  Groups are written once
+//          their window is over, and all of them on level shutdown and
+//          unload.  At most EVENT_COALESCE_MAX_GROUPS are open at once;
+//          starting another writes the oldest early.
+//
+//          Only the game thread uses this.
+//
+//===========================================================================//
+
+#ifndef EVENTCOALESCER_H
+#define EVENTCOALESCER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+#include "vstdlib/IKeyValuesSystem.h"
+#include "utlvector.h"
+
+#include "EventRecord.h"
+
+class CEventWriter;
+struct EventFilterRule_t;
+
+// Most bytes of strings one coalesced event can keep
+#define EVENT_COALESCE_MAX_STRINGS 512
+
+// Most groups open at once, eg. attacker, victim and weapon combinations of
+// player_hurt.  A power of two.
+#define EVENT_COALESCE_MAX_GROUPS 1024
+
+class CEventCoalescer
+{
+public:
+    CEventCoalescer();
+    ~CEventCoalescer();
+
+    // Adds event to its group, starting one if need be.  writer gets the
+    // oldest group if there are too many.
+    void Add(const CEventRecordBuilder& event, const EventFilterRule_t& rule, CEventWriter& writer);
+
+    // Writes the groups whose window is over, or all of them
+    void FlushExpired(CEventWriter& writer);
+    void Flush(CEventWriter& writer);
+
+private:
+    struct CoalescedKey_t
+    {
+        HKeySymbol m_Symbol;
+        KeyValues::types_t m_Type;
+        bool m_bGroup;              // one of the rule's coalesce_by keys
+        bool m_bSum;                // one of its coalesce_sum keys, which are aggregated
+        union                       // the first value, for keys that aren't aggregated
+        {
+            int m_iValue;
+            float m_flValue;
+            uint64 m_ulValue;
+            const char* m_pszValue; // in m_Strings
+        };
+        double m_flSum;
+        double m_flMin;
+        double m_flMax;
+    };
+
+    struct Group_t
+    {
+        const EventFilterRule_t* m_pRule;
+        unsigned m_Hash;            // of the event and its coalesce_by values
+        double m_flStarted;         // Plat_FloatTime of the first event
+        EventTime_t m_Time;
+        int m_iLastCurTime;
+        int m_nCount;
+        int m_nKeys;
+        int m_nOutputKeys;          // keys the coalesced event will have
+        int m_nStringBytes;
+        CoalescedKey_t m_Keys[EVENT_RECORD_MAX_KEYS];
+        char m_Strings[EVENT_COALESCE_MAX_STRINGS];
+    };
+
+    static unsigned GroupHash(const CEventRecordBuilder& event, const EventFilterRule_t& rule);
+    static bool ContainsKey(const CUtlVector<HKeySymbol>& keys, HKeySymbol symbol);
+    static bool Matches(const Group_t* pGroup, const CEventRecordBuilder& event);
+    void Start(Group_t* pGroup, const CEventRecordBuilder& event);
+    CoalescedKey_t* AddKey(Group_t* pGroup, const EventRecordKey_t& src);
+    void Accumulate(Group_t* pGroup, const CEventRecordBuilder& event);
+    void Write(Group_t* pGroup, CEventWriter& writer);
+    void Close(int index);
+
+    CUtlVector<Group_t*> m_Groups;      // open, in the order they were started
+    CUtlVector<Group_t*> m_FreeGroups;  // written, for Add to reuse
+
+    // m_Groups by m_Hash: open-addressed, at most half full, NULL if empty
+    Group_t* m_Slots[EVENT_COALESCE_MAX_GROUPS * 2];
+
+    bool m_bWarnedKeys;             // a key was left out for EVENT_RECORD_MAX_KEYS
+    bool m_bWarnedStrings;          // or for EVENT_COALESCE_MAX_STRINGS
+    bool m_bWarnedGroups;
+};
+
+#endif // EVENTCOALESCER_H
@@ -0,0 +1,101 @@
+//===========================================================================//
+//
+// Purpose: game event descriptions
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "EventDescriptors.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// The engine loads its event descriptions from these, in this order
+static const char* s_DescriptorFiles[] =
+{
+    "resource/serverevents.res",
+    "resource/gameevents.res",
+    "resource/modevents.res",
+};
+
+static KeyValues::types_t KeyType(const char* type)
+{
+    if (Q_stricmp(type, "string") == 0)
+        return KeyValues::TYPE_STRING;
+    if (Q_stricmp(type, "float") == 0)
+        return KeyValues::TYPE_FLOAT;
+    if (Q_stricmp(type, "long") == 0 || Q_stricmp(type, "short") == 0 ||
+        Q_stricmp(type, "byte") == 0 || Q_stricmp(type, "bool") == 0)
+        return KeyValues::TYPE_INT;
+    return KeyValues::TYPE_NONE;
+}
+
+CEventDescriptors::CEventDescriptors()
+    : m_EventIndex(k_eDictCompareTypeCaseSensitive)
+{
+}
+
+CEventDescriptors::~CEventDescriptors()
+{
+    for (int i = 0; i < m_Events.Count(); i++)
+    {
+        EventDescriptor_t* pEvent = m_Events[i];
+        for (int j = 0; j < pEvent->m_Keys.Count(); j++)
+            free(pEvent->m_Keys[j].m_pszName);
+        free(pEvent->m_pszName);
+    }
+    m_Events.PurgeAndDeleteElements();
+}
+
+void CEventDescriptors::Load(IBaseFileSystem* pFileSystem)
+{
+    for (int i = 0; i < ARRAYSIZE(s_DescriptorFiles); i++)
+    {
+        KeyValues* pFile = new KeyValues("gameevents");
+        if (pFile->LoadFromFile(pFileSystem, s_DescriptorFiles[i], "GAME"))
+        {
+            for (KeyValues* pEvent = pFile->GetFirstTrueSubKey(); pEvent; pEvent = pEvent->GetNextTrueSubKey())
+            {
+                // Like the engine, a later description of an event replaces an earlier one
+                EventDescriptor_t* pDescriptor;
+                int index = m_EventIndex.Find(pEvent->GetName());
+                if (index != m_EventIndex.InvalidIndex())
+                {
+                    pDescriptor = m_Events[m_EventIndex[index]];
+                    for (int j = 0; j < pDescriptor->m_Keys.Count(); j++)
+                        free(pDescriptor->m_Keys[j].m_pszName);
+                    pDescriptor->m_Keys.RemoveAll();
+                }
+                else
+                {
+                    pDescriptor = new EventDescriptor_t;
+                    pDescriptor->m_pszName = strdup(pEvent->GetName());
+                    pDescriptor->m_Symbol = pEvent->GetNameSymbol();
+                    m_EventIndex.Insert(pDescriptor->m_pszName, m_Events.AddToTail(pDescriptor));
+                }
+
+                for (KeyValues* pKey = pEvent->GetFirstValue(); pKey; pKey = pKey->GetNextValue())
+                {
+                    EventKeyDescriptor_t key;
+                    key.m_pszName = strdup(pKey->GetName());
+                    key.m_Symbol = KeyValuesSystem()->GetSymbolForString(key.m_pszName);
+                    key.m_Type = KeyType(pKey->GetString());
+                    pDescriptor->m_Keys.AddToTail(key);
+                }
+            }
+        }
+        pFile->deleteThis();
+    }
+
+    Msg("Loaded descriptions of %d game events\n", m_Events.Count());
+}
+
+const EventDescriptor_t* CEventDescriptors::Find(const char* pszName) const
+{
+    int index = m_EventIndex.Find(pszName);
+    return index != m_EventIndex.InvalidIndex() ? m_Events[m_EventIndex[index]] : NULL;
+}
@@ -0,0 +1,59 @@
+//===========================================================================//
+//
+// Purpose: the game's event descriptions, read from the same resource files
+//          the engine reads with IGameEventManager2::LoadEventsFromFile.  They
+//          give the name and type of every key an event can have, which is
+//          what lets events be read straight off IGameEvent and lets the
+//          "wide" storage mode create typed columns.
+//
+//          Loaded on the game thread at Load and read-only after that.
+//
+//===========================================================================//
+
+#ifndef EVENTDESCRIPTORS_H
+#define EVENTDESCRIPTORS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+#include "vstdlib/IKeyValuesSystem.h"
+#include "utldict.h"
+#include "utlvector.h"
+
+class IBaseFileSystem;
+
+struct EventKeyDescriptor_t
+{
+    char* m_pszName;
+    HKeySymbol m_Symbol;
+    KeyValues::types_t m_Type;      // TYPE_STRING, TYPE_INT or TYPE_FLOAT; TYPE_NONE for "local" keys
+};
+
+struct EventDescriptor_t
+{
+    char* m_pszName;
+    HKeySymbol m_Symbol;
+    CUtlVector<EventKeyDescriptor_t> m_Keys;
+};
+
+class CEventDescriptors
+{
+public:
+    CEventDescriptors();
+    ~CEventDescriptors();
+
+    void Load(IBaseFileSystem* pFileSystem);
+
+    int GetCount() const { return m_Events.Count(); }
+    const EventDescriptor_t& Get(int i) const { return *m_Events[i]; }
+
+    // Returns NULL for events that aren't described
+    const EventDescriptor_t* Find(const char* pszName) const;
+
+private:
+    CUtlVector<EventDescriptor_t*> m_Events;
+    CUtlDict<int, int> m_EventIndex;
+};
+
+#endif // EVENTDESCRIPTORS_H
@@ -0,0 +1,211 @@
+//===========================================================================//
+//
+// Purpose: event filter and key projection rules
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "EventFilter.h"
+#include "KeyValues.h"
+#include "filesystem.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static unsigned SlotHash(HKeySymbol symbol)
+{
+    return (unsigned)symbol * 2654435761u >> 16;
+}
+
+CEventFilter::CEventFilter()
+{
+    m_Default.m_Event = INVALID_KEY_SYMBOL;
+    m_Default.m_iIndex = -1;
+    m_Default.m_bInclude = true;
+    m_Default.m_SampleMode = EVENT_SAMPLE_NONE;
+    m_Default.m_iSampleArg = 0;
+    m_Default.m_flCoalesceWindow = 0.0f;
+}
+
+CEventFilter::~CEventFilter()
+{
+    Clear();
+}
+
+void CEventFilter::Clear()
+{
+    m_Default.m_bInclude = true;
+    m_Default.m_Keys.RemoveAll();
+    m_Rules.PurgeAndDeleteElements();
+    m_Slots.RemoveAll();
+}
+
+void CEventFilter::Load(IBaseFileSystem* pFileSystem, const char* pszPath)
+{
+    Clear();
+
+    KeyValues* pFile = new KeyValues("eventlogger_filter");
+    if (!pFile->LoadFromFile(pFileSystem, pszPath, "GAME"))
+    {
+        pFile->deleteThis();
+        return;
+    }
+
+    for (KeyValues* pEvent = pFile->GetFirstSubKey(); pEvent; pEvent = pEvent->GetNextKey())
+    {
+        EventFilterRule_t* pRule;
+        if (Q_stricmp(pEvent->GetName(), "default") == 0)
+        {
+            pRule = &m_Default;
+        }
+        else
+        {
+            pRule = NULL;
+            for (int i = 0; i < m_Rules.Count() && pRule == NULL; i++)
+            {
+                if (m_Rules[i]->m_Event == pEvent->GetNameSymbol())
+                    pRule = m_Rules[i];
+            }
+
+            if (pRule != NULL)
+            {
+                Warning("Event %s is listed more than once in %s; the last one counts\n", pEvent->GetName(), pszPath);
+            }
+            else
+            {
+                pRule = new EventFilterRule_t;
+                pRule->m_Event = pEvent->GetNameSymbol();
+                pRule->m_iIndex = m_Rules.AddToTail(pRule);
+            }
+        }
+
+        pRule->m_Keys.RemoveAll();
+        pRule->m_SampleMode = EVENT_SAMPLE_NONE;
+        pRule->m_iSampleArg = 0;
+        pRule->m_flCoalesceWindow = 0.0f;
+        pRule->m_CoalesceBy.RemoveAll();
+        pRule->m_CoalesceSum.RemoveAll();
+        pRule->m_bInclude = true;
+
+        if (pEvent->GetFirstSubKey() != NULL)
+        {
+            ParseKeys(pRule, pEvent->GetString("keys"));
+            float window = pEvent->GetFloat("coalesce");
+            if (pRule == &m_Default)
+            {
+                if (*pEvent->GetString("sample") != '\0' || window > 0.0f)
+                    Warning("Only named events can be sampled or coalesced; ignoring the default's in %s\n", pszPath);
+            }
+            else if (window > 0.0f)
+            {
+                if (*pEvent->GetString("sample") != '\0')
+                    Warning("Event %s is coalesced, so it isn't sampled too\n", pEvent->GetName());
+                ParseCoalesce(pRule, window, pEvent->GetString("coalesce_by", "userid attacker weapon weaponid"),
+                    pEvent->GetString("coalesce_sum", "damageamount damage amount healing health"));
+            }
+            else
+            {
+                ParseSample(pRule, pEvent->GetString("sample"), pszPath);
+            }
+            continue;
+        }
+
+        const char* value = pEvent->GetString();
+        if (Q_stricmp(value, "exclude") == 0)
+            pRule->m_bInclude = false;
+        else if (Q_stricmp(value, "include") != 0)
+            ParseKeys(pRule, value);
+    }
+    pFile->deleteThis();
+
+    // At most half full, so probes stay short
+    int size = 16;
+    while (size < m_Rules.Count() * 2)
+        size *= 2;
+    m_Slots.SetCount(size);
+    for (int i = 0; i < size; i++)
+        m_Slots[i] = -1;
+    for (int i = 0; i < m_Rules.Count(); i++)
+    {
+        unsigned slot = SlotHash(m_Rules[i]->m_Event) & (size - 1);
+        while (m_Slots[slot] != -1)
+            slot = (slot + 1) & (size - 1);
+        m_Slots[slot] = i;
+    }
+
+    Msg("Loaded %d event filter rules from %s; other events are %s\n", m_Rules.Count(), pszPath, m_Default.m_bInclude ? "logged" : "not logged");
+}
+
+void CEventFilter::ParseKeys(EventFilterRule_t* pRule, const char* pszKeys)
+{
+    char keys[1024];
+    Q_strncpy(keys, pszKeys, sizeof(keys));
+    for (char* key = strtok(keys, " \t,"); key != NULL; key = strtok(NULL, " \t,"))
+        pRule->m_Keys.AddToTail(KeyValuesSystem()->GetSymbolForString(key));
+}
+
+void CEventFilter::ParseSample(EventFilterRule_t* pRule, const char* pszSample, const char* pszPath)
+{
+    if (*pszSample == '\0')
+        return;
+
+    char mode[16];
+    int arg;
+    if (sscanf(pszSample, "%15s %d", mode, &arg) != 2 || arg < 1)
+        mode[0] = '\0';
+
+    if (Q_stricmp(mode, "every") == 0)
+        pRule->m_SampleMode = EVENT_SAMPLE_EVERY;
+    else if (Q_stricmp(mode, "rate") == 0)
+        pRule->m_SampleMode = EVENT_SAMPLE_RATE;
+    else if (Q_stricmp(mode, "reservoir") == 0)
+        pRule->m_SampleMode = EVENT_SAMPLE_RESERVOIR;
+    else
+    {
+        Warning("Event %s has sample \"%s\" in %s; expected \"every N\", \"rate N\" or \"reservoir N\"\n", KeyValuesSystem()->GetStringForSymbol(pRule->m_Event), pszSample, pszPath);
+        return;
+    }
+    pRule->m_iSampleArg = arg;
+
+    // Sampled events carry their weight, whichever keys they keep
+    if (pRule->m_Keys.Count() > 0)
+        pRule->m_Keys.AddToTail(KeyValuesSystem()->GetSymbolForString(EVENT_SAMPLE_WEIGHT_KEY));
+}
+
+void CEventFilter::ParseCoalesce(EventFilterRule_t* pRule, float flWindow, const char* pszBy, const char* pszSum)
+{
+    pRule->m_flCoalesceWindow = flWindow;
+
+    char keys[1024];
+    Q_strncpy(keys, pszSum, sizeof(keys));
+    for (char* key = strtok(keys, " \t,"); key != NULL; key = strtok(NULL, " \t,"))
+        pRule->m_CoalesceSum.AddToTail(KeyValuesSystem()->GetSymbolForString(key));
+
+    Q_strncpy(keys, pszBy, sizeof(keys));
+    for (char* key = strtok(keys, " \t,"); key != NULL; key = strtok(NULL, " \t,"))
+    {
+        HKeySymbol symbol = KeyValuesSystem()->GetSymbolForString(key);
+        pRule->m_CoalesceBy.AddToTail(symbol);
+
+        // Events are told apart by these, so a projection must keep them
+        if (pRule->m_Keys.Count() > 0 && !pRule->KeepsKey(symbol))
+            pRule->m_Keys.AddToTail(symbol);
+    }
+}
+
+const EventFilterRule_t* CEventFilter::Find(HKeySymbol event) const
+{
+    int size = m_Slots.Count();
+    if (size == 0)
+        return &m_Default;
+
+    for (unsigned slot = SlotHash(event) & (size - 1); m_Slots[slot] != -1; slot = (slot + 1) & (size - 1))
+    {
+        const EventFilterRule_t* pRule = m_Rules[m_Slots[slot]];
+        if (pRule->m_Event == event)
+            return pRule;
+    }
+    return &m_Default;
+}
@@ -0,0 +1,119 @@
+//===========================================================================//
+//
+// Purpose: which events are logged, and which of their keys.  Rules are read
+//          from a KeyValues file such as:
+//
+//              "eventlogger_filter"
+//              {
+//                  "default"       "include"
+//                  "player_hurt"   "exclude"
+//                  "player_death"  "userid attacker weapon customkill"
+//              }
+//
+//          Each event is "include", "exclude", or the keys to keep, which
+//          also includes it.  "default" covers events that aren't listed.
+//          An event can instead have a section, which includes it:
+//
+//                  "player_hurt"
+//                  {
+//                      "keys"      "userid attacker damage"
+//                      "sample"    "rate 50"
+//                  }
+//
+//          where "sample" is "every N", "rate N" (per second) or "reservoir N"
+//          (per round); see CEventSampler.  Instead of being sampled, an
+//          event can be coalesced: "coalesce" "1" sums up each second's worth
+//          of events with the same "coalesce_by" keys (by default userid,
+//          attacker, weapon and weaponid) into one, aggregating its
+//          "coalesce_sum" keys (by default damage and healing amounts and
+//          health); see CEventCoalescer.
+//          The file is compiled into a hash table keyed by the event name's
+//          KeyValues symbol, so checking an event doesn't touch its name.
+//
+//          Only the game thread uses this.
+//
+//===========================================================================//
+
+#ifndef EVENTFILTER_H
+#define EVENTFILTER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "vstdlib/IKeyValuesSystem.h"
+#include "utlvector.h"
+
+class IBaseFileSystem;
+
+// Key sampled events carry their sample weight in: how many events each one
+// that was logged stands for.  Events without it stand for just themselves.
+#define EVENT_SAMPLE_WEIGHT_KEY "sample_weight"
+
+enum EventSampleMode_t
+{
+    EVENT_SAMPLE_NONE,
+    EVENT_SAMPLE_EVERY,             // the first of every m_iSampleArg
+    EVENT_SAMPLE_RATE,              // about m_iSampleArg a second
+    EVENT_SAMPLE_RESERVOIR,         // m_iSampleArg a round, chosen uniformly
+};
+
+struct EventFilterRule_t
+{
+    HKeySymbol m_Event;             // INVALID_KEY_SYMBOL for the default rule
+    int m_iIndex;                   // in CEventFilter::GetRule; -1 for the default rule
+    bool m_bInclude;
+    CUtlVector<HKeySymbol> m_Keys;  // keys to keep; every key if empty
+    EventSampleMode_t m_SampleMode; // never set on the default rule
+    int m_iSampleArg;
+    float m_flCoalesceWindow;       // seconds; 0 if the event isn't coalesced
+    CUtlVector<HKeySymbol> m_CoalesceBy;
+    CUtlVector<HKeySymbol> m_CoalesceSum;
+
+    // Keys lists are short, so a scan beats anything cleverer
+    bool KeepsKey(HKeySymbol key) const
+    {
+        if (m_Keys.Count() == 0)
+            return true;
+        for (int i = 0; i < m_Keys.Count(); i++)
+        {
+            if (m_Keys[i] == key)
+                return true;
+        }
+        return false;
+    }
+};
+
+class CEventFilter
+{
+public:
+    CEventFilter();
+    ~CEventFilter();
+
+    // Replaces the rules with those in pszPath.  Without the file, every
+    // event is logged whole.
+    void Load(IBaseFileSystem* pFileSystem, const char* pszPath);
+
+    // The rule for an event; the default rule if it has none of its own
+    const EventFilterRule_t* Find(HKeySymbol event) const;
+    bool IsIncluded(HKeySymbol event) const { return Find(event)->m_bInclude; }
+
+    // Events are only included by name if the default is to exclude them,
+    // in which case these are the events to listen for
+    bool IncludesByDefault() const { return m_Default.m_bInclude; }
+    int GetRuleCount() const { return m_Rules.Count(); }
+    const EventFilterRule_t& GetRule(int i) const { return *m_Rules[i]; }
+
+private:
+    void Clear();
+    void ParseKeys(EventFilterRule_t* pRule, const char* pszKeys);
+    void ParseSample(EventFilterRule_t* pRule, const char* pszSample, const char* pszPath);
+    void ParseCoalesce(EventFilterRule_t* pRule, float flWindow, const char* pszBy, const char* pszSum);
+
+    EventFilterRule_t m_Default;
+    CUtlVector<EventFilterRule_t*> m_Rules;
+
+    // Open-addressed, power of two sized, holding indexes into m_Rules or -1
+    CUtlVector<int> m_Slots;
+};
+
+#endif // EVENTFILTER_H
@@ -20,19 +20,22 @@
 #include "engine/IEngineTrace.h"
 #include "tier2/tier2.h"
 
-#include "libpq-fe.h"
+#include "ClientRegistry.h"
+#include "EventCoalescer.h"
+#include "EventDescriptors.h"
+#include "EventFilter.h"
+#include "EventRecord.h"
+#include "EventSampler.h"
+#include "EventWriter.h"
+#include "PlayerSnapshots.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-// #define DB_CONNECT_STR "host=127.0.0.1 port=5432 dbname=tfstats user=tfstats password=fakepassword"
-#if !defined(DB_CONNECT_STR)
-#error "Define DB_CONNECT_STR with PostgreSQL database connection information, eg. \"host=127.0.0.1 dbname=tfstats user=tfstats password=...\""
-#endif
-
 // Interfaces from the engine
 IVEngineServer	*engine = NULL; // helper functions (messaging clients, loading content, making entities, running commands, etc)
 IGameEventManager *gameeventmanager = NULL; // game events interface
+IGameEventManager2 *gameeventmanager2 = NULL; // game events interface without KeyValues copies
 IPlayerInfoManager *playerinfomanager = NULL; // game dll interface to interact with players
 IBotManager *botmanager = NULL; // game dll interface to interact with bots
 IServerPluginHelpers *helpers = NULL; // special 3rd party plugin helpers from the engine
@@ -41,10 +44,14 @@ IEngineTrace *enginetrace = NULL;
 
 CGlobalVars *gpGlobals = NULL;
 
+static ConVar eventlogger_listener("eventlogger_listener", "1", 0, "Game event interface to listen with: 1 for IGameEventListener, 2 for IGameEventListener2, which reads described keys straight off the event.  Takes effect at the next map", true, 1.0f, true, 2.0f);
+static ConVar eventlogger_filter("eventlogger_filter", "cfg/eventlogger_filter.cfg", 0, "File of rules for which events, and which of their keys, are logged.  Takes effect at the next map");
+static ConVar eventlogger_drain_timeout("eventlogger_drain_timeout", "5", 0, "Seconds to spend writing queued events to the stats database when the plugin is unloaded", true, 0.0f, false, 0.0f);
+
 //---------------------------------------------------------------------------------
 // Purpose: a sample 3rd party plugin class
 //---------------------------------------------------------------------------------
-class CEventLoggerPlugin : public IServerPluginCallbacks, public IGameEventListener
+class CEventLoggerPlugin : public IServerPluginCallbacks, public IGameEventListener, public IGameEventListener2
 {
 public:
     CEventLoggerPlugin();
@@ -73,16 +80,31 @@ public:
     // IGameEventListener Interface
     virtual void FireGameEvent(KeyValues * event);
 
+    // IGameEventListener2 Interface
+    virtual void FireGameEvent(IGameEvent * event);
+
     virtual int GetCommandIndex() { return m_iClientCommandIndex; }
 
+    void PrintStats() { m_Writer.PrintStats(); m_Sampler.PrintStats(); }
+    void Benchmark(const char* pszEvent, int iterations);
+
 private:
-    void LogEvent(KeyValues* event);
-    void DatabaseConnect();
+    void StartListening();
+    void StopListening();
+    void LogEvent(CEventRecordBuilder& event);
+    void LogGameEvent(CEventRecordBuilder& event, const EventFilterRule_t& rule, float weight);
+    void LogNewGameSession();
+    void SetPlayer(CEventRecordBuilder& event, const char* networkId, const char* name);
 
     int m_iClientCommandIndex;
-    char* m_gameSessionId;
-    PGconn* m_db;
     int m_frameCounter;
+    CEventDescriptors m_Descriptors;
+    CEventFilter m_Filter;
+    CEventSampler m_Sampler;
+    CEventCoalescer m_Coalescer;
+    CEventWriter m_Writer;
+    CClientRegistry m_Clients;
+    CPlayerSnapshots m_Snapshots;
 };
 
 
@@ -92,14 +114,23 @@ private:
 CEventLoggerPlugin g_EmtpyServerPlugin;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CEventLoggerPlugin, IServerPluginCallbacks, INTERFACEVERSION_ISERVERPLUGINCALLBACKS, g_EmtpyServerPlugin);
 
+CON_COMMAND(eventlogger_stats, "Prints queue usage, dropped and sampled events, and call counts and timings of the stats database statements")
+{
+    g_EmtpyServerPlugin.PrintStats();
+}
+
+CON_COMMAND(eventlogger_benchmark, "Compares the cost of capturing a game event through IGameEventListener and IGameEventListener2: eventlogger_benchmark [event] [iterations]")
+{
+    g_EmtpyServerPlugin.Benchmark(args.ArgC() > 1 ? args[1] : "player_death", args.ArgC() > 2 ? atoi(args[2]) : 100000);
+}
+
 //---------------------------------------------------------------------------------
 // Purpose: constructor/destructor
 //---------------------------------------------------------------------------------
 CEventLoggerPlugin::CEventLoggerPlugin()
+    : m_Snapshots(m_Clients)
 {
     m_iClientCommandIndex = 0;
-    m_db = NULL;
-    m_gameSessionId = NULL;
     m_frameCounter = 0;
 }
 
@@ -129,6 +160,11 @@ bool CEventLoggerPlugin::Load(CreateInterfaceFn interfaceFactory, CreateInterfac
 
     engine = (IVEngineServer*)interfaceFactory(INTERFACEVERSION_VENGINESERVER, NULL);
     gameeventmanager = (IGameEventManager *)interfaceFactory(INTERFACEVERSION_GAMEEVENTSMANAGER,NULL);
+    gameeventmanager2 = (IGameEventManager2 *)interfaceFactory(INTERFACEVERSION_GAMEEVENTSMANAGER2,NULL);
+    if (!gameeventmanager2)
+    {
+        Warning("Unable to load gameeventmanager2, ignoring\n"); // eventlogger_listener 2 falls back to the old interface
+    }
     helpers = (IServerPluginHelpers*)interfaceFactory(INTERFACEVERSION_ISERVERPLUGINHELPERS, NULL);
     enginetrace = (IEngineTrace *)interfaceFactory(INTERFACEVERSION_ENGINETRACE_SERVER,NULL);
     randomStr = (IUniformRandomStream *)interfaceFactory(VENGINE_SERVER_RANDOM_INTERFACE_VERSION, NULL);
@@ -144,91 +180,58 @@ bool CEventLoggerPlugin::Load(CreateInterfaceFn interfaceFactory, CreateInterfac
         gpGlobals = playerinfomanager->GetGlobalVars();
     }
 
+    m_Clients.Seed();
+
     MathLib_Init(2.2f, 2.2f, 0.0f, 2.0f);
     ConVar_Register(0);
-    DatabaseConnect();
 
-    KeyValues* event = new KeyValues("_plugin_load");
-    LogEvent(event);
-    event->deleteThis();
+    char gameDir[512];
+    engine->GetGameDir(gameDir, sizeof(gameDir));
+    char spoolDir[512];
+    Q_snprintf(spoolDir, sizeof(spoolDir), "%s%ceventlogger_spool", gameDir, CORRECT_PATH_SEPARATOR);
+    m_Descriptors.Load(g_pFullFileSystem);
+    m_Writer.LoadEventDescriptors(m_Descriptors);
+    m_Writer.Start(spoolDir);
 
-    gameeventmanager->AddListener(this, true);
+    StartListening();
+
+    CEventRecordBuilder event("_plugin_load");
+    LogEvent(event);
 
     return true;
 }
 
-void CEventLoggerPlugin::DatabaseConnect()
+//---------------------------------------------------------------------------------
+// Purpose: called on the game thread after the writer thread starts a new
+//          GameSession, to record the map and the clients already connected
+//---------------------------------------------------------------------------------
+void CEventLoggerPlugin::LogNewGameSession()
 {
-    if (m_db != NULL)
+    CEventRecordBuilder event("_new_gamesession");
+    if (gpGlobals != NULL)
     {
-        PQfinish(m_db);
-        m_db = NULL;
-    }
-    if (m_gameSessionId != NULL)
-    {
-        free(m_gameSessionId);
-        m_gameSessionId = NULL;
+        const char* mapname = gpGlobals->mapname.ToCStr();
+        if (mapname != NULL && strlen(mapname) != 0)
+            event.SetString("map_name", mapname);
     }
+    LogEvent(event);
 
-    Msg("Connecting to stats database...\n");
-    m_db = PQconnectdb(DB_CONNECT_STR);
-    if (PQstatus(m_db) != CONNECTION_OK)
+    for (int i = 0; i < m_Clients.GetCount(); i++)
     {
-        Warning("Failed to connect to stats database: %s\n", PQerrorMessage(m_db));
-        PQfinish(m_db);
-        m_db = NULL;
-    }
-    else
-    {
-        Msg("Successfully connected to stats database.\n");
+        const ClientInfo_t& client = m_Clients.Get(i);
 
-        PGresult* res = PQexec(m_db, "INSERT INTO GameSession (Heartbeat) VALUES (NOW()) RETURNING Id");
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
-        {
-            Warning("\"INSERT INTO GameSession\" failed\n");
-            PQclear(res);
-            PQfinish(m_db);
-            m_db = NULL;
-        }
-        else
+        CEventRecordBuilder event("_existing_client");
+        SetPlayer(event, client.m_szNetworkId, client.m_szName);
+        event.SetInt("userid", client.m_iUserId);
+        const PlayerSnapshot_t* snapshot = m_Snapshots.Find(client.m_iUserId);
+        if (snapshot != NULL)
         {
-            m_gameSessionId = strdup(PQgetvalue(res, 0, 0));
-            PQclear(res);
-
-            KeyValues* event = new KeyValues("_new_gamesession");
-            CGlobalVars* globals = playerinfomanager->GetGlobalVars();
-            if (globals != NULL)
-            {
-                const char* mapname = globals->mapname.ToCStr();
-                if (mapname != NULL && strlen(mapname) != 0)
-                    event->SetString("map_name", mapname);
-            }
-            LogEvent(event);
-            event->deleteThis();
-
-            for (int i = 1; i <= globals->maxClients; i++)
-            {
-                edict_t* entity = engine->PEntityOfEntIndex(i);
-                if (!entity || entity->IsFree())
-                    continue;
-
-                IPlayerInfo* player = playerinfomanager->GetPlayerInfo(entity);
-                if (player != NULL)
-                {
-                    KeyValues* event = new KeyValues("_existing_client");
-                    event->SetString("player_name", player->GetName());
-                    event->SetInt("userid", player->GetUserID());
-                    event->SetInt("team", player->GetTeamIndex());
-                    const char* networkId = player->GetNetworkIDString();
-                    if (networkId != NULL)
-                        event->SetString("networkid", networkId);
-                    event->SetInt("health", player->GetHealth());
-                    // FIXME: player class for TF2?
-                    LogEvent(event);
-                    event->deleteThis();
-                }
-            }
+            event.SetInt("team", snapshot->m_iTeam);
+            event.SetInt("health", snapshot->m_iHealth);
+            if (snapshot->m_iClass >= 0)
+                event.SetInt("class", snapshot->m_iClass);
         }
+        LogEvent(event);
     }
 }
 
@@ -237,26 +240,19 @@ void CEventLoggerPlugin::DatabaseConnect()
 //---------------------------------------------------------------------------------
 void CEventLoggerPlugin::Unload(void)
 {
-    gameeventmanager->RemoveListener(this); // make sure we are unloaded from the event system
+    StopListening(); // make sure we are unloaded from the event system
+    m_Sampler.Flush(m_Writer);
+    m_Coalescer.Flush(m_Writer);
+
+    CEventRecordBuilder event("_plugin_unload");
+    LogEvent(event);
+
+    // the writer thread must be gone before the tier libraries are disconnected
+    m_Writer.Stop(eventlogger_drain_timeout.GetFloat());
 
     ConVar_Unregister();
     DisconnectTier2Libraries();
     DisconnectTier1Libraries();
-
-    KeyValues* event = new KeyValues("_plugin_unload");
-    LogEvent(event);
-    event->deleteThis();
-
-    if (m_db != NULL)
-    {
-        PQfinish(m_db);
-        m_db = NULL;
-    }
-    if (m_gameSessionId != NULL)
-    {
-        free(m_gameSessionId);
-        m_gameSessionId = NULL;
-    }
 }
 
 //---------------------------------------------------------------------------------
@@ -286,11 +282,11 @@ const char *CEventLoggerPlugin::GetPluginDescription(void)
 //---------------------------------------------------------------------------------
 void CEventLoggerPlugin::LevelInit( char const *pMapName )
 {
-    gameeventmanager->AddListener(this, true);
+    StartListening();
 
-    KeyValues* event = new KeyValues("_level_init", "map_name", pMapName);
+    CEventRecordBuilder event("_level_init");
+    event.SetString("map_name", pMapName);
     LogEvent(event);
-    event->deleteThis();
 }
 
 //---------------------------------------------------------------------------------
@@ -302,12 +298,11 @@ void CEventLoggerPlugin::ServerActivate(edict_t *pEdictList, int edictCount, int
     char gameDir[512];
     engine->GetGameDir(gameDir, 512);
 
-    KeyValues* event = new KeyValues("_server_activate");
-    event->SetInt("client_max", clientMax);
-    event->SetInt("app_id", engine->GetAppID());
-    event->SetString("game_dir", gameDir);
+    CEventRecordBuilder event("_server_activate");
+    event.SetInt("client_max", clientMax);
+    event.SetInt("app_id", engine->GetAppID());
+    event.SetString("game_dir", gameDir);
     LogEvent(event);
-    event->deleteThis();
 }
 
 //---------------------------------------------------------------------------------
@@ -315,27 +310,19 @@ void CEventLoggerPlugin::ServerActivate(edict_t *pEdictList, int edictCount, int
 //---------------------------------------------------------------------------------
 void CEventLoggerPlugin::GameFrame(bool simulating)
 {
+    m_Snapshots.Invalidate();
+
+    if (m_Writer.CheckNewGameSession())
+        LogNewGameSession();
+
+    m_Coalescer.FlushExpired(m_Writer);
+
     if (simulating)
     {
         if (++m_frameCounter == 1800)   // 30s * 60 frames/sec
         {
             m_frameCounter = 0;
-
-            if (m_db == NULL || PQstatus(m_db) != CONNECTION_OK)
-                DatabaseConnect();
-
-            if (m_db != NULL && PQstatus(m_db) == CONNECTION_OK)
-            {
-                const Oid paramTypes[] = { 23, };
-                const char* const values[] = { m_gameSessionId };
-                const int lengths[] = { strlen(m_gameSessionId) };
-                const int paramFormats[] = { 0, 0, 0 };
-                PGresult* res = PQexecParams(m_db, "UPDATE GameSession SET Heartbeat = NOW() WHERE Id = $1", 1, paramTypes, values, lengths, paramFormats, 0);
-                ExecStatusType resStatus = PQresultStatus(res);
-                PQclear(res);
-                if (resStatus != PGRES_COMMAND_OK)
-                    Warning("\"UPDATE GameSession SET Heartbeat\" failed\n");
-            }
+            m_Writer.RequestHeartbeat();
         }
     }
 }
@@ -345,11 +332,13 @@ void CEventLoggerPlugin::GameFrame(bool simulating)
 //---------------------------------------------------------------------------------
 void CEventLoggerPlugin::LevelShutdown(void) // !!!!this can get called multiple times per map change
 {
-    gameeventmanager->RemoveListener(this);
+    StopListening();
+    m_Snapshots.Invalidate();
+    m_Sampler.Flush(m_Writer);
+    m_Coalescer.Flush(m_Writer);
 
-    KeyValues* event = new KeyValues("_level_shutdown");
+    CEventRecordBuilder event("_level_shutdown");
     LogEvent(event);
-    event->deleteThis();
 }
 
 //---------------------------------------------------------------------------------
@@ -360,12 +349,15 @@ void CEventLoggerPlugin::ClientActive(edict_t *pEntity)
     int user_id = engine->GetPlayerUserId(pEntity);
     const char* networkId = engine->GetPlayerNetworkIDString(pEntity);
 
-    KeyValues* event = new KeyValues("_client_active");
-    event->SetInt("userid", user_id);
-    if (networkId != NULL)
-        event->SetString("networkid", networkId);
+    IPlayerInfo* player = playerinfomanager != NULL ? playerinfomanager->GetPlayerInfo(pEntity) : NULL;
+    const char* name = player != NULL ? player->GetName() : NULL;
+    m_Clients.Update(pEntity, user_id, networkId, name);
+    m_Clients.SetActive(pEntity);
+
+    CEventRecordBuilder event("_client_active");
+    event.SetInt("userid", user_id);
+    SetPlayer(event, networkId, name);
     LogEvent(event);
-    event->deleteThis();
 }
 
 //---------------------------------------------------------------------------------
@@ -376,12 +368,12 @@ void CEventLoggerPlugin::ClientDisconnect(edict_t *pEntity)
     int user_id = engine->GetPlayerUserId(pEntity);
     const char* networkId = engine->GetPlayerNetworkIDString(pEntity);
 
-    KeyValues* event = new KeyValues("_client_disconnect");
-    event->SetInt("userid", user_id);
-    if (networkId != NULL)
-        event->SetString("networkid", networkId);
+    CEventRecordBuilder event("_client_disconnect");
+    event.SetInt("userid", user_id);
+    SetPlayer(event, networkId, NULL);
     LogEvent(event);
-    event->deleteThis();
+
+    m_Clients.Remove(pEntity);
 }
 
 //---------------------------------------------------------------------------------
@@ -392,13 +384,12 @@ void CEventLoggerPlugin::ClientPutInServer(edict_t *pEntity, char const *playern
     int user_id = engine->GetPlayerUserId(pEntity);
     const char* networkId = engine->GetPlayerNetworkIDString(pEntity);
 
-    KeyValues* event = new KeyValues("_client_put_in_server");
-    event->SetString("player_name", playername);
-    event->SetInt("userid", user_id);
-    if (networkId != NULL)
-        event->SetString("networkid", networkId);
+    m_Clients.Update(pEntity, user_id, networkId, playername);
+
+    CEventRecordBuilder event("_client_put_in_server");
+    event.SetInt("userid", user_id);
+    SetPlayer(event, networkId, playername);
     LogEvent(event);
-    event->deleteThis();
 }
 
 //---------------------------------------------------------------------------------
@@ -424,14 +415,13 @@ PLUGIN_RESULT CEventLoggerPlugin::ClientConnect( bool *bAllowConnect, edict_t *p
     int user_id = engine->GetPlayerUserId(pEntity);
     const char* networkId = engine->GetPlayerNetworkIDString(pEntity);
 
-    KeyValues* event = new KeyValues("_client_connect");
-    event->SetString("player_name", pszName);
-    event->SetInt("userid", user_id);
-    event->SetString("address", pszAddress);
-    if (networkId != NULL)
-        event->SetString("networkid", networkId);
+    m_Clients.Update(pEntity, user_id, networkId, pszName);
+
+    CEventRecordBuilder event("_client_connect");
+    event.SetInt("userid", user_id);
+    event.SetString("address", pszAddress);
+    SetPlayer(event, networkId, pszName);
     LogEvent(event);
-    event->deleteThis();
 
     return PLUGIN_CONTINUE;
 }
@@ -449,11 +439,13 @@ PLUGIN_RESULT CEventLoggerPlugin::ClientCommand( edict_t *pEntity, const CComman
 //---------------------------------------------------------------------------------
 PLUGIN_RESULT CEventLoggerPlugin::NetworkIDValidated( const char *pszUserName, const char *pszNetworkID )
 {
-    KeyValues* event = new KeyValues("_network_id_validated");
-    event->SetString("player_name", pszUserName);
-    event->SetString("networkid", pszNetworkID);
+    ClientInfo_t* client = m_Clients.Validate(pszUserName, pszNetworkID);
+
+    CEventRecordBuilder event("_network_id_validated");
+    if (client != NULL)
+        event.SetInt("userid", client->m_iUserId);
+    SetPlayer(event, pszNetworkID, pszUserName);
     LogEvent(event);
-    event->deleteThis();
 
     return PLUGIN_CONTINUE;
 }
@@ -470,123 +462,228 @@ void CEventLoggerPlugin::OnQueryCvarValueFinished( QueryCvarCookie_t iCookie, ed
 //---------------------------------------------------------------------------------
 void CEventLoggerPlugin::FireGameEvent(KeyValues * event)
 {
-    LogEvent(event);
+    HKeySymbol name = event->GetNameSymbol();
+    if (m_Sampler.HasReservoirs() && m_Sampler.IsRoundBoundary(name))
+        m_Sampler.Flush(m_Writer);
+
+    const EventFilterRule_t* rule = m_Filter.Find(name);
+    float weight;
+    if (!rule->m_bInclude || !m_Sampler.Sample(*rule, &weight))
+        return;
+
+    CEventRecordBuilder record(event, rule);
+    LogGameEvent(record, *rule, weight);
 }
 
-void CEventLoggerPlugin::LogEvent(KeyValues* event)
+//---------------------------------------------------------------------------------
+// Purpose: called when an event is fired, with eventlogger_listener 2
+//---------------------------------------------------------------------------------
+void CEventLoggerPlugin::FireGameEvent(IGameEvent * event)
 {
-    const char * name = event->GetName();
+    const EventDescriptor_t* descriptor = m_Descriptors.Find(event->GetName());
+    if (descriptor == NULL)
+        return;
+
+    if (m_Sampler.HasReservoirs() && m_Sampler.IsRoundBoundary(descriptor->m_Symbol))
+        m_Sampler.Flush(m_Writer);
 
-    if (m_db == NULL || PQstatus(m_db) != CONNECTION_OK)
+    const EventFilterRule_t* rule = m_Filter.Find(descriptor->m_Symbol);
+    float weight;
+    if (!rule->m_bInclude || !m_Sampler.Sample(*rule, &weight))
         return;
 
-    if (PQresultStatus(PQexec(m_db, "BEGIN TRANSACTION")) != PGRES_COMMAND_OK)
+    CEventRecordBuilder record(event, *descriptor, rule);
+    LogGameEvent(record, *rule, weight);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: weights and enriches a game event the sampler kept, then queues
+//          it, holds it in the sampler's reservoir until the round ends, or
+//          adds it to the coalescer
+//---------------------------------------------------------------------------------
+void CEventLoggerPlugin::LogGameEvent(CEventRecordBuilder& event, const EventFilterRule_t& rule, float weight)
+{
+    // The weight goes in ahead of the players' state, which can fill the event
+    if (weight != 1.0f && rule.m_flCoalesceWindow <= 0.0f)
+        m_Sampler.AddWeight(event, rule, weight);
+    m_Snapshots.Enrich(event);
+
+    if (rule.m_flCoalesceWindow > 0.0f)
     {
-        Warning("\"BEGIN TRANSACTION\" for event data failed: %s", PQerrorMessage(m_db));
+        m_Coalescer.Add(event, rule, m_Writer);
         return;
     }
 
-    bool dbFailure = false;
-    PGresult* res;
+    if (rule.m_SampleMode == EVENT_SAMPLE_RESERVOIR)
+        m_Sampler.Hold(rule, m_Writer.CaptureEvent(event, m_Sampler.GetArenas()));
+    else
+        m_Writer.QueueEvent(event);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: reloads the event filter and registers for game events.
+//          IGameEventManager2 has no way to listen to every event, so each
+//          described event is listened to by name; events the engine loads from
+//          files of its own aren't seen then.  Excluded events aren't listened
+//          to at all where that can be helped, so the engine doesn't copy them
+//          for us only to have them thrown away, unless a sampling reservoir
+//          needs to know when rounds end.
+//---------------------------------------------------------------------------------
+void CEventLoggerPlugin::StartListening()
+{
+    StopListening();
+
+    m_Sampler.Flush(m_Writer);
+    m_Coalescer.Flush(m_Writer);
+    m_Filter.Load(g_pFullFileSystem, eventlogger_filter.GetString());
+    m_Sampler.Configure(m_Filter);
+
+    if (eventlogger_listener.GetInt() == 2 && gameeventmanager2 != NULL)
+    {
+        for (int i = 0; i < m_Descriptors.GetCount(); i++)
+        {
+            const EventDescriptor_t& descriptor = m_Descriptors.Get(i);
+            if (m_Filter.IsIncluded(descriptor.m_Symbol) || (m_Sampler.HasReservoirs() && m_Sampler.IsRoundBoundary(descriptor.m_Symbol)))
+                gameeventmanager2->AddListener(this, descriptor.m_pszName, true);
+        }
+    }
+    else if (!m_Filter.IncludesByDefault())
     {
-        const Oid paramTypes[] = { 23, 25 };
-        const char* const values[] = { m_gameSessionId, name };
-        const int lengths[] = { strlen(m_gameSessionId), strlen(name) };
-        const int paramFormats[] = { 0, 0 };
-        res = PQexecParams(m_db, "INSERT INTO Event (GameSessionId, Name) VALUES ($1, $2) RETURNING Id", 2, paramTypes, values, lengths, paramFormats, 0);
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        for (int i = 0; i < m_Filter.GetRuleCount(); i++)
+        {
+            const EventFilterRule_t& rule = m_Filter.GetRule(i);
+            const char* pszEvent = KeyValuesSystem()->GetStringForSymbol(rule.m_Event);
+            if (rule.m_bInclude && !gameeventmanager->AddListener(this, pszEvent, true))
+                Warning("Unable to listen for event %s, which the filter includes\n", pszEvent);
+        }
+
+        // Not every game has every round event, so failing here is expected
+        for (int i = 0; m_Sampler.HasReservoirs() && i < m_Sampler.GetRoundBoundaryCount(); i++)
         {
-            Warning("\"INSERT INTO Event\" failed\n");
-            PQclear(res);
-            if (PQresultStatus(PQexec(m_db, "ROLLBACK TRANSACTION")) != PGRES_COMMAND_OK)
-                Warning("\"ROLLBACK TRANSACTION\" for failed event failed: %s", PQerrorMessage(m_db));
-            return;
+            HKeySymbol event = m_Sampler.GetRoundBoundary(i);
+            if (!m_Filter.IsIncluded(event))
+                gameeventmanager->AddListener(this, KeyValuesSystem()->GetStringForSymbol(event), true);
         }
     }
+    else
+    {
+        gameeventmanager->AddListener(this, true);
+    }
+}
 
-    char* eventId = strdup(PQgetvalue(res, 0, 0));
-    PQclear(res);
+void CEventLoggerPlugin::StopListening()
+{
+    gameeventmanager->RemoveListener(this);
+    if (gameeventmanager2 != NULL)
+        gameeventmanager2->RemoveListener(this);
+}
 
-    for (KeyValues *pKey = event->GetFirstSubKey(); pKey; pKey = pKey->GetNextKey())
+//---------------------------------------------------------------------------------
+// Purpose: times capturing pszEvent both ways.  The legacy path is measured
+//          from the KeyValues copy the engine makes for each IGameEventListener;
+//          neither includes enrichment or queueing, which are the same for both.
+//---------------------------------------------------------------------------------
+void CEventLoggerPlugin::Benchmark(const char* pszEvent, int iterations)
+{
+    const EventDescriptor_t* descriptor = m_Descriptors.Find(pszEvent);
+    if (descriptor == NULL)
     {
-        const char* keyName = pKey->GetName();
+        Warning("There is no description of event %s\n", pszEvent);
+        return;
+    }
+    if (gameeventmanager2 == NULL)
+    {
+        Warning("Benchmarking needs gameeventmanager2\n");
+        return;
+    }
+    IGameEvent* event = gameeventmanager2->CreateEvent(pszEvent, true);
+    if (event == NULL)
+    {
+        Warning("Unable to create event %s\n", pszEvent);
+        return;
+    }
+    if (iterations < 1)
+        iterations = 1;
 
-        switch (pKey->GetDataType())
+    CEventArenas arenas;
+
+    // Every key gets a value, as a real event's would
+    KeyValues* keys = new KeyValues(pszEvent);
+    for (int i = 0; i < descriptor->m_Keys.Count(); i++)
+    {
+        const EventKeyDescriptor_t& key = descriptor->m_Keys[i];
+        switch (key.m_Type)
         {
-        case KeyValues::TYPE_STRING:
-            {
-                const char* keyValue = pKey->GetString();
-
-                const Oid paramTypes[] = { 23, 25, 25 };
-                const char* const values[] = { eventId, keyName, keyValue };
-                const int lengths[] = { strlen(eventId), strlen(keyName), strlen(keyValue) };
-                const int paramFormats[] = { 0, 0, 0 };
-                res = PQexecParams(m_db, "INSERT INTO EventData (EventId, Key, ValueString) VALUES ($1, $2, $3)", 3, paramTypes, values, lengths, paramFormats, 0);
-                ExecStatusType resStatus = PQresultStatus(res);
-                PQclear(res);
-                if (resStatus != PGRES_COMMAND_OK)
-                {
-                    dbFailure = true;
-                    Warning("\"INSERT INTO EventData\" for string data failed: %s\n", PQerrorMessage(m_db));
-                }
-            }
-            break;
         case KeyValues::TYPE_INT:
-            {
-                int keyValue = pKey->GetInt();
-                char keyValueStr[255];
-                Q_snprintf(keyValueStr, 255, "%i", keyValue);
-
-                const Oid paramTypes[] = { 23, 25, 23 };
-                const char* const values[] = { eventId, keyName, keyValueStr };
-                const int lengths[] = { strlen(eventId), strlen(keyName), strlen(keyValueStr) };
-                const int paramFormats[] = { 0, 0, 0 };
-                res = PQexecParams(m_db, "INSERT INTO EventData (EventId, Key, ValueInt) VALUES ($1, $2, $3)", 3, paramTypes, values, lengths, paramFormats, 0);
-                ExecStatusType resStatus = PQresultStatus(res);
-                PQclear(res);
-                if (resStatus != PGRES_COMMAND_OK)
-                {
-                    dbFailure = true;
-                    Warning("\"INSERT INTO EventData\" for int data failed: %s\n", PQerrorMessage(m_db));
-                }
-            }
+            event->SetInt(key.m_pszName, i + 1);
+            keys->SetInt(key.m_pszName, i + 1);
             break;
         case KeyValues::TYPE_FLOAT:
-            {
-                float keyValue = pKey->GetFloat();
-                char keyValueStr[255];
-                Q_snprintf(keyValueStr, 255, "%f", keyValue);
-
-                const Oid paramTypes[] = { 23, 25, 700 };
-                const char* const values[] = { eventId, keyName, keyValueStr };
-                const int lengths[] = { strlen(eventId), strlen(keyName), strlen(keyValueStr) };
-                const int paramFormats[] = { 0, 0, 0 };
-                res = PQexecParams(m_db, "INSERT INTO EventData (EventId, Key, ValueFloat) VALUES ($1, $2, $3)", 3, paramTypes, values, lengths, paramFormats, 0);
-                ExecStatusType resStatus = PQresultStatus(res);
-                PQclear(res);
-                if (resStatus != PGRES_COMMAND_OK)
-                {
-                    dbFailure = true;
-                    Warning("\"INSERT INTO EventData\" for float data failed: %s\n", PQerrorMessage(m_db));
-                }
-            }
+            event->SetFloat(key.m_pszName, i + 0.5f);
+            keys->SetFloat(key.m_pszName, i + 0.5f);
             break;
         default:
-            Warning("Event %s has key %s with data type <#%d> that could not be logged\n", name, pKey->GetName(), pKey->GetDataType());
+            event->SetString(key.m_pszName, "benchmark");
+            keys->SetString(key.m_pszName, "benchmark");
             break;
         }
     }
 
-    free(eventId);
+    double start = Plat_FloatTime();
+    for (int i = 0; i < iterations; i++)
+    {
+        KeyValues* copy = keys->MakeCopy();
+        CEventRecordBuilder record(copy);
+        delete record.Finish(&arenas);
+        copy->deleteThis();
+    }
+    double legacy = Plat_FloatTime() - start;
 
-    if (!dbFailure)
+    start = Plat_FloatTime();
+    for (int i = 0; i < iterations; i++)
     {
-        if (PQresultStatus(PQexec(m_db, "COMMIT TRANSACTION")) != PGRES_COMMAND_OK)
-            Warning("\"COMMIT TRANSACTION\" for event failed: %s", PQerrorMessage(m_db));
+        const EventDescriptor_t* found = m_Descriptors.Find(event->GetName());
+        CEventRecordBuilder record(event, *found);
+        delete record.Finish(&arenas);
     }
-    else
+    double listener2 = Plat_FloatTime() - start;
+
+    Msg("%s, %d keys, %d iterations:\n", pszEvent, descriptor->m_Keys.Count(), iterations);
+    Msg("  IGameEventListener:  %.3f us/event\n", legacy * 1000000.0 / iterations);
+    Msg("  IGameEventListener2: %.3f us/event\n", listener2 * 1000000.0 / iterations);
+
+    keys->deleteThis();
+    gameeventmanager2->FreeEvent(event);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: identifies the player an event is about.  Players with a Steam ID
+//          are referred to by it, and their name goes to the Player table
+//          instead of the event; anyone else keeps their name and network id.
+//---------------------------------------------------------------------------------
+void CEventLoggerPlugin::SetPlayer(CEventRecordBuilder& event, const char* networkId, const char* name)
+{
+    uint64 steamId = CClientRegistry::SteamIDFromNetworkID(networkId);
+    if (steamId != 0)
     {
-        if (PQresultStatus(PQexec(m_db, "ROLLBACK TRANSACTION")) != PGRES_COMMAND_OK)
-            Warning("\"ROLLBACK TRANSACTION\" for failed event failed: %s", PQerrorMessage(m_db));
+        event.SetUint64("steamid", steamId);
+        if (name != NULL)
+            m_Writer.QueuePlayer(steamId, name);
+        return;
     }
+
+    if (name != NULL)
+        event.SetString("player_name", name);
+    if (networkId != NULL)
+        event.SetString("networkid", networkId);
+}
+
+void CEventLoggerPlugin::LogEvent(CEventRecordBuilder& event)
+{
+    const EventFilterRule_t* rule = m_Filter.Find(KeyValuesSystem()->GetSymbolForString(event.GetName()));
+    if (!rule->m_bInclude)
+        return;
+
+    event.Project(*rule);
+    m_Writer.QueueEvent(event);
 }
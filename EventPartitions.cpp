@@ -0,0 +1,233 @@
+//===========================================================================//
+//
+// Purpose: Event and EventData partition management
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "EventPartitions.h"
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "convar.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static void PartitionChanged(IConVar* var, const char* pOldValue, float flOldValue);
+static ConVar eventlogger_partition("eventlogger_partition", "daily", 0, "Size of the Event and EventData partitions the plugin creates: \"daily\", \"weekly\", or \"none\" to leave partitions alone", PartitionChanged);
+static ConVar eventlogger_partition_ahead("eventlogger_partition_ahead", "7", 0, "Days of partitions to create ahead of time", true, 1.0f, true, 365.0f);
+static ConVar eventlogger_partition_retention("eventlogger_partition_retention", "0", 0, "Days after which partitions are removed from Event and EventData; 0 keeps them forever", true, 0.0f, false, 0.0f);
+static ConVar eventlogger_partition_drop("eventlogger_partition_drop", "0", 0, "Drop expired partitions instead of detaching them");
+
+// How often partitions are checked while connected, in seconds
+#define PARTITION_CHECK_INTERVAL 3600.0
+
+// SQLSTATE for creating a partition whose range the default partition
+// already has rows in
+#define SQLSTATE_CHECK_VIOLATION "23514"
+
+static const char* s_PartitionedTables[] = { "Event", "EventData" };
+
+// The interval of eventlogger_partition, or NULL for "none".  Maintain runs on
+// the writer thread, which must not read the ConVar's string while the game
+// thread may be replacing it.
+static const char* volatile s_pszPeriod = "day";
+
+static const char* ParsePeriod(const char* partition)
+{
+    if (Q_stricmp(partition, "daily") == 0)
+        return "day";
+    if (Q_stricmp(partition, "weekly") == 0)
+        return "week";
+    return NULL;
+}
+
+static void PartitionChanged(IConVar* var, const char* pOldValue, float flOldValue)
+{
+    s_pszPeriod = ParsePeriod(eventlogger_partition.GetString());
+}
+
+CEventPartitions::CEventPartitions()
+    : m_Abandoned(k_eDictCompareTypeCaseInsensitive)
+{
+    m_flNextRun = 0.0;
+}
+
+void CEventPartitions::Reset()
+{
+    m_flNextRun = 0.0;
+}
+
+void CEventPartitions::ReadSettings()
+{
+    s_pszPeriod = ParsePeriod(eventlogger_partition.GetString());
+}
+
+bool CEventPartitions::IsDue() const
+{
+    return Plat_FloatTime() >= m_flNextRun;
+}
+
+void CEventPartitions::Maintain(PGconn* db)
+{
+    m_flNextRun = Plat_FloatTime() + PARTITION_CHECK_INTERVAL;
+
+    const char* period = s_pszPeriod;
+    if (period == NULL)
+        return;
+
+    CreatePartitions(db, period, eventlogger_partition_ahead.GetInt());
+    if (eventlogger_partition_retention.GetInt() > 0)
+        ExpirePartitions(db, period, eventlogger_partition_retention.GetInt(), eventlogger_partition_drop.GetBool());
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: creates the partitions covering today through ahead days from now.
+//          The server works out the boundaries so they agree with the NOW()
+//          that fills in DateTime.
+//---------------------------------------------------------------------------------
+bool CEventPartitions::CreatePartitions(PGconn* db, const char* period, int ahead)
+{
+    char sql[512];
+    Q_snprintf(sql, sizeof(sql),
+        "SELECT to_char(d, 'YYYYMMDD'), d, d + interval '1 %s' FROM generate_series("
+        "date_trunc('%s', LOCALTIMESTAMP), LOCALTIMESTAMP + interval '%d days', interval '1 %s') AS d",
+        period, period, ahead, period);
+    PGresult* res = PQexec(db, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        Warning("Listing Event partitions to create failed: %s", PQerrorMessage(db));
+        PQclear(res);
+        return false;
+    }
+
+    bool success = true;
+    for (int i = 0; i < PQntuples(res); i++)
+    {
+        for (int j = 0; j < ARRAYSIZE(s_PartitionedTables); j++)
+        {
+            char partition[64];
+            Q_snprintf(partition, sizeof(partition), "%s_%s", s_PartitionedTables[j], PQgetvalue(res, i, 0));
+            if (m_Abandoned.Find(partition) != m_Abandoned.InvalidIndex())
+                continue;
+            if (!CreatePartition(db, s_PartitionedTables[j], partition, PQgetvalue(res, i, 1), PQgetvalue(res, i, 2)))
+                success = false;
+        }
+    }
+    PQclear(res);
+    return success;
+}
+
+bool CEventPartitions::CreatePartition(PGconn* db, const char* table, const char* partition, const char* from, const char* to)
+{
+    char sql[512];
+    Q_snprintf(sql, sizeof(sql),
+        "CREATE TABLE IF NOT EXISTS %s PARTITION OF %s FOR VALUES FROM ('%s') TO ('%s')",
+        partition, table, from, to);
+    PGresult* res = PQexec(db, sql);
+    ExecStatusType resStatus = PQresultStatus(res);
+    const char* sqlState = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    bool bDefaultHasRows = (sqlState != NULL && strcmp(sqlState, SQLSTATE_CHECK_VIOLATION) == 0);
+    PQclear(res);
+    if (resStatus == PGRES_COMMAND_OK)
+        return true;
+    if (!bDefaultHasRows)
+    {
+        Warning("\"%s\" failed: %s", sql, PQerrorMessage(db));
+        return false;
+    }
+
+    if (MoveFromDefault(db, table, partition, from, to))
+        return true;
+
+    Warning("Leaving %s's rows from %s to %s in its default partition; %s won't be created again until the plugin is reloaded\n", table, from, to, partition);
+    m_Abandoned.Insert(partition, 0);
+    return false;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: creates a partition for a range the default partition already has
+//          rows in, eg. events written while the partition was missing or
+//          replayed from the spool, and moves those rows into it.  The default
+//          partition is detached while that happens, all in one transaction.
+//---------------------------------------------------------------------------------
+bool CEventPartitions::MoveFromDefault(PGconn* db, const char* table, const char* partition, const char* from, const char* to)
+{
+    if (!Exec(db, "BEGIN TRANSACTION"))
+        return false;
+
+    char steps[5][512];
+    Q_snprintf(steps[0], sizeof(steps[0]), "ALTER TABLE %s DETACH PARTITION %s_default", table, table);
+    Q_snprintf(steps[1], sizeof(steps[1]), "CREATE TABLE %s PARTITION OF %s FOR VALUES FROM ('%s') TO ('%s')", partition, table, from, to);
+    Q_snprintf(steps[2], sizeof(steps[2]), "INSERT INTO %s SELECT * FROM %s_default WHERE DateTime >= '%s' AND DateTime < '%s'", table, table, from, to);
+    Q_snprintf(steps[3], sizeof(steps[3]), "DELETE FROM %s_default WHERE DateTime >= '%s' AND DateTime < '%s'", table, from, to);
+    Q_snprintf(steps[4], sizeof(steps[4]), "ALTER TABLE %s ATTACH PARTITION %s_default DEFAULT", table, table);
+    for (int i = 0; i < ARRAYSIZE(steps); i++)
+    {
+        if (!Exec(db, steps[i]))
+        {
+            Exec(db, "ROLLBACK TRANSACTION");
+            return false;
+        }
+    }
+
+    if (!Exec(db, "COMMIT TRANSACTION"))
+        return false;
+    Msg("Created partition %s from rows in %s_default\n", partition, table);
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: detaches or drops the partitions that end before the retention period
+//---------------------------------------------------------------------------------
+bool CEventPartitions::ExpirePartitions(PGconn* db, const char* period, int retention, bool bDrop)
+{
+    // Partition names end in the YYYYMMDD their range starts on, so they can be
+    // compared as strings with the start of the oldest period to keep.
+    char sql[512];
+    Q_snprintf(sql, sizeof(sql),
+        "SELECT parent.relname, child.relname FROM pg_inherits"
+        " JOIN pg_class parent ON parent.oid = pg_inherits.inhparent"
+        " JOIN pg_class child ON child.oid = pg_inherits.inhrelid"
+        " WHERE parent.relname IN ('event', 'eventdata')"
+        " AND child.relname ~ '_[0-9]{8}$'"
+        " AND substring(child.relname from '[0-9]{8}$') < to_char(date_trunc('%s', LOCALTIMESTAMP - interval '%d days'), 'YYYYMMDD')",
+        period, retention);
+    PGresult* res = PQexec(db, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        Warning("Listing expired Event partitions failed: %s", PQerrorMessage(db));
+        PQclear(res);
+        return false;
+    }
+
+    bool success = true;
+    for (int i = 0; i < PQntuples(res); i++)
+    {
+        if (bDrop)
+            Q_snprintf(sql, sizeof(sql), "DROP TABLE %s", PQgetvalue(res, i, 1));
+        else
+            Q_snprintf(sql, sizeof(sql), "ALTER TABLE %s DETACH PARTITION %s", PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
+        if (Exec(db, sql))
+            Msg("%s partition %s\n", bDrop ? "Dropped" : "Detached", PQgetvalue(res, i, 1));
+        else
+            success = false;
+    }
+    PQclear(res);
+    return success;
+}
+
+bool CEventPartitions::Exec(PGconn* db, const char* sql)
+{
+    PGresult* res = PQexec(db, sql);
+    ExecStatusType resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COMMAND_OK)
+    {
+        Warning("\"%s\" failed: %s", sql, PQerrorMessage(db));
+        return false;
+    }
+    return true;
+}
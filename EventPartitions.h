@@ -0,0 +1,54 @@
+//===========================================================================//
+//
+// Purpose: keeps the Event and EventData tables' range partitions on DateTime
+//          up to date: partitions for the coming days or weeks are created
+//          ahead of time, and with a retention period set, partitions past it
+//          are detached or dropped as a whole instead of DELETEd row by row.
+//
+//          Only the writer thread uses this, between batches.
+//
+//===========================================================================//
+
+#ifndef EVENTPARTITIONS_H
+#define EVENTPARTITIONS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utldict.h"
+
+#include "libpq-fe.h"
+
+class CEventPartitions
+{
+public:
+    CEventPartitions();
+
+    // Call after connecting, so that partitions are checked straight away.
+    void Reset();
+
+    // Reads eventlogger_partition; call on the game thread before the writer
+    // starts.  Later changes are picked up by the ConVar's change callback.
+    void ReadSettings();
+
+    // True once it's time to run Maintain again.
+    bool IsDue() const;
+    double GetNextRun() const { return m_flNextRun; }
+
+    void Maintain(PGconn* db);
+
+private:
+    bool CreatePartitions(PGconn* db, const char* period, int ahead);
+    bool CreatePartition(PGconn* db, const char* table, const char* partition, const char* from, const char* to);
+    bool MoveFromDefault(PGconn* db, const char* table, const char* partition, const char* from, const char* to);
+    bool ExpirePartitions(PGconn* db, const char* period, int retention, bool bDrop);
+    bool Exec(PGconn* db, const char* sql);
+
+    double m_flNextRun;
+
+    // Partitions that couldn't be made out of rows in the default partition,
+    // which are left there rather than failing every run
+    CUtlDict<int, int> m_Abandoned;
+};
+
+#endif // EVENTPARTITIONS_H
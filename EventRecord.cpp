@@ -0,0 +1,501 @@
+//===========================================================================//
+//
+// Purpose: a flattened copy of a game event
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <limits.h>
+#include <float.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#include "EventRecord.h"
+#include "EventArena.h"
+#include "EventDescriptors.h"
+#include "EventFilter.h"
+#include "edict.h"
+#include "igameevents.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+extern CGlobalVars* gpGlobals;
+
+//---------------------------------------------------------------------------------
+// Purpose: the clocks events are stamped with, in microseconds
+//---------------------------------------------------------------------------------
+static uint64 WallClockMicroseconds()
+{
+#ifdef _WIN32
+    // FILETIME counts 100ns intervals since 1601-01-01
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    uint64 intervals = ((uint64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return intervals / 10 - (uint64)11644473600 * 1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static uint64 MonotonicMicroseconds()
+{
+#ifdef _WIN32
+    // Plat_FloatTime is QueryPerformanceCounter on Windows
+    return (uint64)(Plat_FloatTime() * 1000000.0);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void CEventRecord::operator delete(void* p)
+{
+    CEventArenas::Free(p);
+}
+
+const char* CEventRecord::GetKeyName(int i) const
+{
+    const EventRecordKey_t& key = m_pKeys[i];
+    return key.m_pszName != NULL ? key.m_pszName : KeyValuesSystem()->GetStringForSymbol(key.m_Symbol);
+}
+
+bool CEventRecord::SetFloat(HKeySymbol name, float value)
+{
+    for (int i = 0; i < m_nKeys; i++)
+    {
+        if (m_pKeys[i].m_Symbol == name && m_pKeys[i].m_Type == KeyValues::TYPE_FLOAT)
+        {
+            m_pKeys[i].m_flValue = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void PutSpoolString(CUtlBuffer& buf, const char* str, int len)
+{
+    buf.PutInt(len);
+    buf.Put(str, len);
+}
+
+static void PutSpoolString(CUtlBuffer& buf, const char* str)
+{
+    PutSpoolString(buf, str, strlen(str));
+}
+
+void CEventRecord::Serialize(CUtlBuffer& buf) const
+{
+    PutSpoolString(buf, m_pszName);
+    buf.PutInt(m_nKeys);
+    for (int i = 0; i < m_nKeys; i++)
+    {
+        const EventRecordKey_t& key = m_pKeys[i];
+        PutSpoolString(buf, GetKeyName(i));
+        buf.PutUnsignedChar((unsigned char)key.m_Type);
+        switch (key.m_Type)
+        {
+        case KeyValues::TYPE_STRING:
+            PutSpoolString(buf, key.m_pszValue, key.m_nLength);
+            break;
+        case KeyValues::TYPE_INT:
+            buf.PutInt(key.m_iValue);
+            break;
+        case KeyValues::TYPE_FLOAT:
+            buf.PutFloat(key.m_flValue);
+            break;
+        case KeyValues::TYPE_UINT64:
+            buf.Put(&key.m_ulValue, sizeof(key.m_ulValue));
+            break;
+        default:
+            break;
+        }
+    }
+
+    buf.Put(&m_Time.m_ulWallClock, sizeof(m_Time.m_ulWallClock));
+    buf.Put(&m_Time.m_ulMonotonic, sizeof(m_Time.m_ulMonotonic));
+    buf.PutInt(m_Time.m_iTick);
+    buf.PutInt(m_Time.m_iCurTime);
+
+    buf.Put(&m_ulSeq, sizeof(m_ulSeq));
+    buf.PutInt(m_iEventId);
+    buf.PutInt(m_iGameSessionId);
+}
+
+CEventRecordBuilder::CEventRecordBuilder()
+{
+    m_pszName = NULL;
+    memset(&m_Time, 0, sizeof(m_Time));
+    m_nKeys = 0;
+    m_nStringBytes = 0;
+    m_bTruncated = false;
+    m_pProjection = NULL;
+    m_ulSeq = 0;
+    m_iEventId = 0;
+    m_iGameSessionId = 0;
+}
+
+CEventRecordBuilder::CEventRecordBuilder(const char* pszName)
+{
+    SetName(pszName);
+    StampTime();
+    m_nKeys = 0;
+    m_nStringBytes = 0;
+    m_bTruncated = false;
+    m_pProjection = NULL;
+    m_ulSeq = 0;
+    m_iEventId = 0;
+    m_iGameSessionId = 0;
+}
+
+CEventRecordBuilder::CEventRecordBuilder(KeyValues* event, const EventFilterRule_t* pProjection)
+{
+    // KeyValues names are symbol strings already, which are never freed
+    m_pszName = event->GetName();
+    StampTime();
+    m_nKeys = 0;
+    m_nStringBytes = 0;
+    m_bTruncated = false;
+    m_pProjection = pProjection;
+    m_ulSeq = 0;
+    m_iEventId = 0;
+    m_iGameSessionId = 0;
+
+    for (KeyValues *pKey = event->GetFirstSubKey(); pKey; pKey = pKey->GetNextKey())
+    {
+        if (IsProjectedOut(pKey->GetNameSymbol()))
+            continue;
+
+        switch (pKey->GetDataType())
+        {
+        case KeyValues::TYPE_STRING:
+            AddString(pKey->GetNameSymbol(), pKey->GetString());
+            break;
+        case KeyValues::TYPE_INT:
+            AddInt(pKey->GetNameSymbol(), pKey->GetInt());
+            break;
+        case KeyValues::TYPE_FLOAT:
+            AddFloat(pKey->GetNameSymbol(), pKey->GetFloat());
+            break;
+        case KeyValues::TYPE_UINT64:
+            AddUint64(pKey->GetNameSymbol(), pKey->GetUint64());
+            break;
+        default:
+            Warning("Event %s has key %s with data type <#%d> that could not be logged\n", m_pszName, pKey->GetName(), pKey->GetDataType());
+            break;
+        }
+    }
+}
+
+CEventRecordBuilder::CEventRecordBuilder(IGameEvent* event, const EventDescriptor_t& descriptor, const EventFilterRule_t* pProjection)
+{
+    SetName(descriptor.m_pszName);
+    StampTime();
+    m_nKeys = 0;
+    m_nStringBytes = 0;
+    m_bTruncated = false;
+    m_pProjection = pProjection;
+    m_ulSeq = 0;
+    m_iEventId = 0;
+    m_iGameSessionId = 0;
+
+    // Keys the event wasn't given are left out, as they are from the KeyValues
+    // copy.  Rather than asking IsEmpty first, each key is read once with a
+    // default no real value would have.
+    for (int i = 0; i < descriptor.m_Keys.Count(); i++)
+    {
+        const EventKeyDescriptor_t& desc = descriptor.m_Keys[i];
+        if (IsProjectedOut(desc.m_Symbol))
+            continue;
+
+        switch (desc.m_Type)
+        {
+        case KeyValues::TYPE_INT:
+        {
+            int value = event->GetInt(desc.m_pszName, INT_MIN);
+            if (value != INT_MIN)
+                AddInt(desc.m_Symbol, value);
+            break;
+        }
+        case KeyValues::TYPE_FLOAT:
+        {
+            float value = event->GetFloat(desc.m_pszName, -FLT_MAX);
+            if (value != -FLT_MAX)
+                AddFloat(desc.m_Symbol, value);
+            break;
+        }
+        default:
+        {
+            const char* value = event->GetString(desc.m_pszName, NULL);
+            if (value != NULL)
+                AddString(desc.m_Symbol, value);
+            break;
+        }
+        }
+    }
+}
+
+void CEventRecordBuilder::SetName(const char* pszName)
+{
+    m_pszName = KeyValuesSystem()->GetStringForSymbol(KeyValuesSystem()->GetSymbolForString(pszName));
+}
+
+void CEventRecordBuilder::StampTime()
+{
+    m_Time.m_ulWallClock = WallClockMicroseconds();
+    m_Time.m_ulMonotonic = MonotonicMicroseconds();
+    if (gpGlobals != NULL)
+    {
+        m_Time.m_iTick = gpGlobals->tickcount;
+        m_Time.m_iCurTime = (int)(gpGlobals->curtime * 1000.0f);
+    }
+    else
+    {
+        m_Time.m_iTick = 0;
+        m_Time.m_iCurTime = 0;
+    }
+}
+
+bool CEventRecordBuilder::IsProjectedOut(HKeySymbol name) const
+{
+    return m_pProjection != NULL && !m_pProjection->KeepsKey(name);
+}
+
+void CEventRecordBuilder::Project(const EventFilterRule_t& rule)
+{
+    // The dropped keys' strings stay behind in m_Strings, which is harmless
+    int kept = 0;
+    for (int i = 0; i < m_nKeys; i++)
+    {
+        if (rule.KeepsKey(m_Keys[i].m_Symbol))
+            m_Keys[kept++] = m_Keys[i];
+    }
+    m_nKeys = kept;
+}
+
+EventRecordKey_t* CEventRecordBuilder::AddKey(HKeySymbol name, KeyValues::types_t type)
+{
+    if (IsProjectedOut(name))
+        return NULL;
+
+    if (m_nKeys == EVENT_RECORD_MAX_KEYS)
+    {
+        if (!m_bTruncated)
+        {
+            Warning("Event %s has more than %d keys; the rest were not logged\n", m_pszName, EVENT_RECORD_MAX_KEYS);
+            m_bTruncated = true;
+        }
+        return NULL;
+    }
+
+    EventRecordKey_t* pKey = &m_Keys[m_nKeys++];
+    pKey->m_Symbol = name;
+    pKey->m_pszName = NULL;
+    pKey->m_Type = type;
+    pKey->m_iKeyId = 0;
+    pKey->m_nLength = 0;
+    pKey->m_ulValue = 0;
+    return pKey;
+}
+
+const char* CEventRecordBuilder::CopyString(const char* str, int len)
+{
+    if (m_nStringBytes + len + 1 > EVENT_RECORD_MAX_STRINGS)
+    {
+        if (!m_bTruncated)
+        {
+            Warning("Event %s has more than %d bytes of strings; the rest were not logged\n", m_pszName, EVENT_RECORD_MAX_STRINGS);
+            m_bTruncated = true;
+        }
+        return NULL;
+    }
+
+    char* copy = m_Strings + m_nStringBytes;
+    memcpy(copy, str, len + 1);
+    m_nStringBytes += len + 1;
+    return copy;
+}
+
+void CEventRecordBuilder::AddString(HKeySymbol name, const char* value)
+{
+    if (IsProjectedOut(name))
+        return;
+
+    int len = strlen(value);
+    const char* copy = CopyString(value, len);
+    if (copy == NULL)
+        return;
+
+    EventRecordKey_t* pKey = AddKey(name, KeyValues::TYPE_STRING);
+    if (pKey != NULL)
+    {
+        pKey->m_pszValue = copy;
+        pKey->m_nLength = len;
+    }
+}
+
+void CEventRecordBuilder::AddInt(HKeySymbol name, int value)
+{
+    EventRecordKey_t* pKey = AddKey(name, KeyValues::TYPE_INT);
+    if (pKey != NULL)
+        pKey->m_iValue = value;
+}
+
+void CEventRecordBuilder::AddFloat(HKeySymbol name, float value)
+{
+    EventRecordKey_t* pKey = AddKey(name, KeyValues::TYPE_FLOAT);
+    if (pKey != NULL)
+        pKey->m_flValue = value;
+}
+
+void CEventRecordBuilder::AddUint64(HKeySymbol name, uint64 value)
+{
+    EventRecordKey_t* pKey = AddKey(name, KeyValues::TYPE_UINT64);
+    if (pKey != NULL)
+        pKey->m_ulValue = value;
+}
+
+void CEventRecordBuilder::SetString(const char* pszKey, const char* value)
+{
+    AddString(KeyValuesSystem()->GetSymbolForString(pszKey), value);
+}
+
+void CEventRecordBuilder::SetInt(const char* pszKey, int value)
+{
+    AddInt(KeyValuesSystem()->GetSymbolForString(pszKey), value);
+}
+
+void CEventRecordBuilder::SetFloat(const char* pszKey, float value)
+{
+    AddFloat(KeyValuesSystem()->GetSymbolForString(pszKey), value);
+}
+
+void CEventRecordBuilder::SetUint64(const char* pszKey, uint64 value)
+{
+    AddUint64(KeyValuesSystem()->GetSymbolForString(pszKey), value);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: reads a spooled string into the string storage
+//---------------------------------------------------------------------------------
+static const char* GetSpoolString(CUtlBuffer& buf, char* storage, int& used, int* pLength = NULL)
+{
+    int len = buf.GetInt();
+    if (!buf.IsValid() || len < 0 || len > buf.GetBytesRemaining() || used + len + 1 > EVENT_RECORD_MAX_STRINGS)
+        return NULL;
+
+    char* str = storage + used;
+    buf.Get(str, len);
+    str[len] = '\0';
+    used += len + 1;
+    if (pLength != NULL)
+        *pLength = len;
+    return str;
+}
+
+bool CEventRecordBuilder::Unserialize(CUtlBuffer& buf)
+{
+    m_nKeys = 0;
+    m_nStringBytes = 0;
+    m_ulSeq = 0;
+    m_iEventId = 0;
+    m_iGameSessionId = 0;
+
+    m_pszName = GetSpoolString(buf, m_Strings, m_nStringBytes);
+    if (m_pszName == NULL)
+        return false;
+
+    int count = buf.GetInt();
+    if (!buf.IsValid() || count < 0 || count > EVENT_RECORD_MAX_KEYS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        EventRecordKey_t& key = m_Keys[m_nKeys++];
+        key.m_Symbol = INVALID_KEY_SYMBOL;
+        key.m_pszName = GetSpoolString(buf, m_Strings, m_nStringBytes);
+        if (key.m_pszName == NULL)
+            return false;
+        key.m_Type = (KeyValues::types_t)buf.GetUnsignedChar();
+        key.m_iKeyId = 0;
+        key.m_nLength = 0;
+        key.m_ulValue = 0;
+
+        switch (key.m_Type)
+        {
+        case KeyValues::TYPE_STRING:
+            key.m_pszValue = GetSpoolString(buf, m_Strings, m_nStringBytes, &key.m_nLength);
+            if (key.m_pszValue == NULL)
+                return false;
+            break;
+        case KeyValues::TYPE_INT:
+            key.m_iValue = buf.GetInt();
+            break;
+        case KeyValues::TYPE_FLOAT:
+            key.m_flValue = buf.GetFloat();
+            break;
+        case KeyValues::TYPE_UINT64:
+            buf.Get(&key.m_ulValue, sizeof(key.m_ulValue));
+            break;
+        default:
+            return false;
+        }
+
+        if (!buf.IsValid())
+            return false;
+    }
+
+    buf.Get(&m_Time.m_ulWallClock, sizeof(m_Time.m_ulWallClock));
+    buf.Get(&m_Time.m_ulMonotonic, sizeof(m_Time.m_ulMonotonic));
+    m_Time.m_iTick = buf.GetInt();
+    m_Time.m_iCurTime = buf.GetInt();
+
+    buf.Get(&m_ulSeq, sizeof(m_ulSeq));
+    m_iEventId = buf.GetInt();
+    m_iGameSessionId = buf.GetInt();
+    return buf.IsValid();
+}
+
+CEventRecord* CEventRecordBuilder::Finish(CEventArenas* pArenas) const
+{
+    // One allocation: the record, then its keys, then the strings they point to
+    int keysOffset = AlignValue(sizeof(CEventRecord), 8);
+    int stringsOffset = keysOffset + m_nKeys * sizeof(EventRecordKey_t);
+    int size = stringsOffset + m_nStringBytes;
+
+    char* p = (char*)(pArenas != NULL ? pArenas->Alloc(size) : CEventArenas::AllocHeap(size));
+    CEventRecord* pRecord = (CEventRecord*)p;
+    pRecord->m_Time = m_Time;
+    pRecord->m_ulSeq = m_ulSeq;
+    pRecord->m_iEventId = m_iEventId;
+    pRecord->m_iGameSessionId = m_iGameSessionId;
+    pRecord->m_iTypeId = 0;
+    pRecord->m_nKeys = m_nKeys;
+    pRecord->m_pKeys = (EventRecordKey_t*)(p + keysOffset);
+
+    char* pStrings = p + stringsOffset;
+    memcpy(pStrings, m_Strings, m_nStringBytes);
+    memcpy(pRecord->m_pKeys, m_Keys, m_nKeys * sizeof(EventRecordKey_t));
+
+    // Point everything that was in m_Strings at the record's copy
+    const char* pBegin = m_Strings;
+    const char* pEnd = m_Strings + m_nStringBytes;
+    pRecord->m_pszName = (m_pszName >= pBegin && m_pszName < pEnd) ? pStrings + (m_pszName - pBegin) : m_pszName;
+    for (int i = 0; i < m_nKeys; i++)
+    {
+        EventRecordKey_t& key = pRecord->m_pKeys[i];
+        if (key.m_pszName != NULL)
+            key.m_pszName = pStrings + (key.m_pszName - pBegin);
+        if (key.m_Type == KeyValues::TYPE_STRING)
+            key.m_pszValue = pStrings + (key.m_pszValue - pBegin);
+    }
+    return pRecord;
+}
@@ -0,0 +1,190 @@
+//===========================================================================//
+//
+// Purpose: a flattened copy of a game event.  Records are captured on the game
+//          thread and handed to the database writer thread, so they must not
+//          reference any engine-owned memory.
+//
+//          An event is built up in a CEventRecordBuilder, which has fixed
+//          room for keys and strings and so can live on the stack, then copied
+//          to a CEventRecord: a single allocation holding the record, its keys
+//          and all of its strings, carved from a CEventArenas arena.
+//
+//===========================================================================//
+
+#ifndef EVENTRECORD_H
+#define EVENTRECORD_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+#include "vstdlib/IKeyValuesSystem.h"
+#include "utlbuffer.h"
+
+class CEventArenas;
+class IGameEvent;
+struct EventDescriptor_t;
+struct EventFilterRule_t;
+
+// Most keys and bytes of key names and string values one event can have.  A
+// networked game event can't be more than MAX_EVENT_BYTES (1024) anyway.
+#define EVENT_RECORD_MAX_KEYS 64
+#define EVENT_RECORD_MAX_STRINGS 4096
+
+// When an event was captured, taken as it fires on the game thread, so that
+// queuing, batching and spool replay don't move it.
+struct EventTime_t
+{
+    uint64 m_ulWallClock;           // microseconds since 1970-01-01 UTC
+    uint64 m_ulMonotonic;           // microseconds on a clock that is never stepped; only
+                                    // comparable between events from the same server process
+    int m_iTick;                    // gpGlobals->tickcount
+    int m_iCurTime;                 // gpGlobals->curtime in milliseconds
+};
+
+struct EventRecordKey_t
+{
+    // Captured keys only keep the KeyValues symbol of their name, which is
+    // never freed, so capturing a key doesn't copy or scan its name.  Keys read
+    // back from the spool have their own copy of the name instead.
+    HKeySymbol m_Symbol;
+    const char* m_pszName;
+    KeyValues::types_t m_Type;      // TYPE_STRING, TYPE_INT, TYPE_FLOAT or TYPE_UINT64
+    int m_iKeyId;                   // EventKey.Id, filled in by the writer
+    int m_nLength;                  // strlen of m_pszValue, for TYPE_STRING
+    union
+    {
+        int m_iValue;
+        float m_flValue;
+        uint64 m_ulValue;
+        const char* m_pszValue;
+    };
+};
+
+class CEventRecord
+{
+public:
+    // Records are made by CEventRecordBuilder::Finish, and deleting one gives
+    // its memory back to the arena or heap it came from.
+    static void operator delete(void* p);
+
+    // Binary encoding used by the on-disk spool; see CEventRecordBuilder::Unserialize
+    void Serialize(CUtlBuffer& buf) const;
+
+    const char* GetName() const { return m_pszName; }
+    const EventTime_t& GetTime() const { return m_Time; }
+    int GetKeyCount() const { return m_nKeys; }
+    const EventRecordKey_t& GetKey(int i) const { return m_pKeys[i]; }
+    const char* GetKeyName(int i) const;
+
+    // Overwrites a float key the record was built with, for values that
+    // aren't known until after it is captured.  Returns false if there's none.
+    bool SetFloat(HKeySymbol name, float value);
+
+    // Dictionary ids of the event name and keys, looked up by the writer thread
+    // just before the record is written.  They are not spooled.
+    int GetTypeId() const { return m_iTypeId; }
+    void SetTypeId(int id) { m_iTypeId = id; }
+    void SetKeyId(int i, int id) { m_pKeys[i].m_iKeyId = id; }
+
+    // Event.Seq, given out in capture order as the record is queued
+    uint64 GetSeq() const { return m_ulSeq; }
+    void SetSeq(uint64 seq) { m_ulSeq = seq; }
+
+    // Event.Id and GameSessionId, assigned the first time the writer tries to
+    // write the record and spooled with it, so that writing it again finds
+    // the rows already there rather than duplicating them.  0 until then.
+    int GetEventId() const { return m_iEventId; }
+    void SetEventId(int id) { m_iEventId = id; }
+    int GetGameSessionId() const { return m_iGameSessionId; }
+    void SetGameSessionId(int id) { m_iGameSessionId = id; }
+
+private:
+    friend class CEventRecordBuilder;
+    CEventRecord() {}
+    CEventRecord(const CEventRecord&);
+    CEventRecord& operator=(const CEventRecord&);
+
+    const char* m_pszName;
+    EventTime_t m_Time;
+    uint64 m_ulSeq;
+    int m_iEventId;
+    int m_iGameSessionId;
+    int m_iTypeId;
+    int m_nKeys;
+    EventRecordKey_t* m_pKeys;      // follow the record, and are followed by its strings
+};
+
+class CEventRecordBuilder
+{
+public:
+    // For Unserialize
+    CEventRecordBuilder();
+
+    // The other constructors stamp the event with the current time.
+    // pszName is looked up as a KeyValues symbol, so it needn't outlive the builder.
+    CEventRecordBuilder(const char* pszName);
+
+    // Game events are projected as they are read: keys pProjection doesn't
+    // keep, including ones added later, are skipped.
+    CEventRecordBuilder(KeyValues* event, const EventFilterRule_t* pProjection = NULL);
+
+    // Reads the keys descriptor lists straight off event, rather than from the
+    // KeyValues copy the engine makes for IGameEventListener.  "local" keys
+    // have no declared type, so they are read as strings.
+    CEventRecordBuilder(IGameEvent* event, const EventDescriptor_t& descriptor, const EventFilterRule_t* pProjection = NULL);
+
+    void SetString(const char* pszKey, const char* value);
+    void SetInt(const char* pszKey, int value);
+    void SetFloat(const char* pszKey, float value);
+    void SetUint64(const char* pszKey, uint64 value);
+
+    // Adds a key by symbol, eg. player state that wasn't part of the game event
+    void AddString(HKeySymbol name, const char* value);
+    void AddInt(HKeySymbol name, int value);
+    void AddFloat(HKeySymbol name, float value);
+    void AddUint64(HKeySymbol name, uint64 value);
+
+    // Drops the keys rule doesn't keep from an event built up by hand
+    void Project(const EventFilterRule_t& rule);
+
+    const char* GetName() const { return m_pszName; }
+    const EventTime_t& GetTime() const { return m_Time; }
+    int GetKeyCount() const { return m_nKeys; }
+    const EventRecordKey_t& GetKey(int i) const { return m_Keys[i]; }
+
+    // For events summarizing others, which take the time of the first of them
+    void SetTime(const EventTime_t& time) { m_Time = time; }
+
+    // Reads a record written by CEventRecord::Serialize.  Returns false if the
+    // buffer doesn't hold a complete record.
+    bool Unserialize(CUtlBuffer& buf);
+
+    // Copies the event to a record allocated from pArenas, or from the heap if
+    // pArenas is NULL.
+    CEventRecord* Finish(CEventArenas* pArenas) const;
+
+private:
+    CEventRecordBuilder(const CEventRecordBuilder&);
+    CEventRecordBuilder& operator=(const CEventRecordBuilder&);
+
+    void SetName(const char* pszName);
+    void StampTime();
+    bool IsProjectedOut(HKeySymbol name) const;
+    EventRecordKey_t* AddKey(HKeySymbol name, KeyValues::types_t type);
+    const char* CopyString(const char* str, int len);
+
+    const char* m_pszName;
+    EventTime_t m_Time;
+    uint64 m_ulSeq;                 // these three only come from Unserialize
+    int m_iEventId;
+    int m_iGameSessionId;
+    int m_nKeys;
+    int m_nStringBytes;
+    bool m_bTruncated;              // warned that keys didn't fit
+    const EventFilterRule_t* m_pProjection;
+    EventRecordKey_t m_Keys[EVENT_RECORD_MAX_KEYS];
+    char m_Strings[EVENT_RECORD_MAX_STRINGS];
+};
+
+#endif // EVENTRECORD_H
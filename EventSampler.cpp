@@ -0,0 +1,243 @@
+//===========================================================================//
+//
+// Purpose: sampling of high frequency events
+//
+//===========================================================================//
+
+#include <time.h>
+
+#include "EventSampler.h"
+#include "EventFilter.h"
+#include "EventRecord.h"
+#include "EventWriter.h"
+#include "tier0/platform.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Events that start or end a round, in TF2 and the other games
+static const char* s_RoundBoundaries[] =
+{
+    "teamplay_round_start",
+    "teamplay_round_win",
+    "teamplay_round_stalemate",
+    "round_start",
+    "round_end",
+};
+
+CEventSampler::CEventSampler()
+{
+    m_bHasReservoirs = false;
+    m_WeightKey = INVALID_KEY_SYMBOL;
+    m_Random.SetSeed((int)time(NULL));
+}
+
+CEventSampler::~CEventSampler()
+{
+    Clear();
+}
+
+void CEventSampler::Clear()
+{
+    for (int i = 0; i < m_States.Count(); i++)
+    {
+        if (m_States[i] != NULL)
+            m_States[i]->m_Reservoir.PurgeAndDeleteElements();
+    }
+    m_States.PurgeAndDeleteElements();
+    m_bHasReservoirs = false;
+}
+
+void CEventSampler::Configure(const CEventFilter& filter)
+{
+    Clear();
+
+    if (m_WeightKey == INVALID_KEY_SYMBOL)
+    {
+        m_WeightKey = KeyValuesSystem()->GetSymbolForString(EVENT_SAMPLE_WEIGHT_KEY);
+        for (int i = 0; i < ARRAYSIZE(s_RoundBoundaries); i++)
+            m_RoundBoundaries.AddToTail(KeyValuesSystem()->GetSymbolForString(s_RoundBoundaries[i]));
+    }
+
+    for (int i = 0; i < filter.GetRuleCount(); i++)
+    {
+        const EventFilterRule_t& rule = filter.GetRule(i);
+        SampleState_t* pState = NULL;
+        if (rule.m_bInclude && rule.m_SampleMode != EVENT_SAMPLE_NONE)
+        {
+            pState = new SampleState_t;
+            pState->m_pRule = &rule;
+            pState->m_nSeen = 0;
+            pState->m_nKept = 0;
+            pState->m_flWindowStart = 0.0;
+            pState->m_nWindowSeen = 0;
+            pState->m_nLastWindowSeen = 0;
+            pState->m_nRoundSeen = 0;
+            pState->m_iHoldSlot = -1;
+            pState->m_nUnweighted = 0;
+            if (rule.m_SampleMode == EVENT_SAMPLE_RESERVOIR)
+                m_bHasReservoirs = true;
+        }
+        m_States.AddToTail(pState);
+    }
+}
+
+bool CEventSampler::Sample(const EventFilterRule_t& rule, float* pWeight)
+{
+    *pWeight = 1.0f;
+    if (rule.m_iIndex < 0 || rule.m_iIndex >= m_States.Count() || m_States[rule.m_iIndex] == NULL)
+        return true;
+
+    SampleState_t* pState = m_States[rule.m_iIndex];
+    int n = rule.m_iSampleArg;
+    bool keep;
+    switch (rule.m_SampleMode)
+    {
+    case EVENT_SAMPLE_EVERY:
+        keep = pState->m_nSeen % n == 0;
+        *pWeight = (float)n;
+        break;
+
+    case EVENT_SAMPLE_RATE:
+        {
+            // The chance an event is kept depends only on the events before
+            // it, so weighting it by the inverse of that chance is unbiased
+            double now = Plat_FloatTime();
+            if (now - pState->m_flWindowStart >= 1.0)
+            {
+                pState->m_nLastWindowSeen = now - pState->m_flWindowStart < 2.0 ? pState->m_nWindowSeen : 0;
+                pState->m_flWindowStart = now;
+                pState->m_nWindowSeen = 0;
+            }
+            int busiest = max(pState->m_nLastWindowSeen, ++pState->m_nWindowSeen);
+            if (busiest <= n)
+            {
+                keep = true;
+            }
+            else
+            {
+                float chance = (float)n / busiest;
+                keep = m_Random.RandomFloat() < chance;
+                *pWeight = 1.0f / chance;
+            }
+        }
+        break;
+
+    case EVENT_SAMPLE_RESERVOIR:
+        // The i'th event of a round replaces a random one of the n held with
+        // chance n/i, leaving each of the round's events equally likely held
+        pState->m_nRoundSeen++;
+        if (pState->m_Reservoir.Count() < n)
+        {
+            keep = true;
+            pState->m_iHoldSlot = -1;
+        }
+        else
+        {
+            pState->m_iHoldSlot = m_Random.RandomInt(0, pState->m_nRoundSeen - 1);
+            keep = pState->m_iHoldSlot < n;
+        }
+        *pWeight = 0.0f;
+        break;
+
+    default:
+        keep = true;
+        break;
+    }
+
+    pState->m_nSeen++;
+    if (keep && rule.m_SampleMode != EVENT_SAMPLE_RESERVOIR)
+        pState->m_nKept++;
+    return keep;
+}
+
+void CEventSampler::AddWeight(CEventRecordBuilder& event, const EventFilterRule_t& rule, float weight)
+{
+    int count = event.GetKeyCount();
+    event.AddFloat(m_WeightKey, weight);
+
+    // Flush counts reservoir events when it finds no weight to set
+    if (event.GetKeyCount() == count && rule.m_SampleMode != EVENT_SAMPLE_RESERVOIR && m_States.IsValidIndex(rule.m_iIndex) && m_States[rule.m_iIndex] != NULL)
+        CountUnweighted(m_States[rule.m_iIndex]);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: an event logged without its weight counts as one event in
+//          SUM(COALESCE(sample_weight, 1)), so the estimate comes up short
+//---------------------------------------------------------------------------------
+void CEventSampler::CountUnweighted(SampleState_t* pState)
+{
+    if (pState->m_nUnweighted++ == 0)
+    {
+        Warning("%s events already have %d keys, leaving no room for %s; their counts will be underestimated\n",
+            KeyValuesSystem()->GetStringForSymbol(pState->m_pRule->m_Event), EVENT_RECORD_MAX_KEYS, EVENT_SAMPLE_WEIGHT_KEY);
+    }
+}
+
+void CEventSampler::Hold(const EventFilterRule_t& rule, CEventRecord* pRecord)
+{
+    SampleState_t* pState = m_States[rule.m_iIndex];
+    if (pState->m_iHoldSlot < 0)
+    {
+        pState->m_Reservoir.AddToTail(pRecord);
+    }
+    else
+    {
+        delete pState->m_Reservoir[pState->m_iHoldSlot];
+        pState->m_Reservoir[pState->m_iHoldSlot] = pRecord;
+    }
+}
+
+bool CEventSampler::IsRoundBoundary(HKeySymbol event) const
+{
+    for (int i = 0; i < m_RoundBoundaries.Count(); i++)
+    {
+        if (m_RoundBoundaries[i] == event)
+            return true;
+    }
+    return false;
+}
+
+void CEventSampler::Flush(CEventWriter& writer)
+{
+    for (int i = 0; i < m_States.Count(); i++)
+    {
+        SampleState_t* pState = m_States[i];
+        if (pState == NULL || pState->m_Reservoir.Count() == 0)
+            continue;
+
+        float weight = (float)pState->m_nRoundSeen / pState->m_Reservoir.Count();
+        for (int j = 0; j < pState->m_Reservoir.Count(); j++)
+        {
+            if (!pState->m_Reservoir[j]->SetFloat(m_WeightKey, weight))
+                CountUnweighted(pState);
+            writer.QueueRecord(pState->m_Reservoir[j]);
+        }
+        pState->m_nKept += pState->m_Reservoir.Count();
+        pState->m_Reservoir.RemoveAll();
+        pState->m_nRoundSeen = 0;
+    }
+}
+
+void CEventSampler::PrintStats() const
+{
+    bool header = false;
+    for (int i = 0; i < m_States.Count(); i++)
+    {
+        const SampleState_t* pState = m_States[i];
+        if (pState == NULL)
+            continue;
+
+        if (!header)
+        {
+            Msg("Sampled events since the map started (logged / fired):\n");
+            header = true;
+        }
+        Msg("  %-32s %8d / %8d", KeyValuesSystem()->GetStringForSymbol(pState->m_pRule->m_Event), pState->m_nKept, pState->m_nSeen);
+        if (pState->m_Reservoir.Count() > 0)
+            Msg(", %d held this round", pState->m_Reservoir.Count());
+        if (pState->m_nUnweighted > 0)
+            Msg(", %d without %s", pState->m_nUnweighted, EVENT_SAMPLE_WEIGHT_KEY);
+        Msg("\n");
+    }
+}
@@ -0,0 +1,100 @@
+//===========================================================================//
+//
+// Purpose: samples high frequency events, as the event filter's "sample"
+//          rules say.  Each event logged is weighted by how many it stands
+//          for, in its sample_weight key, so that sums and counts weighted by
+//          it estimate the whole:
+//
+//              every N:      the first of every N, weighted N.
+//              rate N:       each event is kept with probability N over the
+//                            busier of this second and the last so far, and
+//                            weighted by the inverse of that probability.
+//              reservoir N:  N of each round's events, chosen uniformly and
+//                            held until the round ends, when each is
+//                            weighted by how many there were over N.
+//
+//          Only the game thread uses this.
+//
+//===========================================================================//
+
+#ifndef EVENTSAMPLER_H
+#define EVENTSAMPLER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "vstdlib/IKeyValuesSystem.h"
+#include "vstdlib/random.h"
+#include "utlvector.h"
+
+#include "EventArena.h"
+
+class CEventFilter;
+class CEventRecord;
+class CEventRecordBuilder;
+class CEventWriter;
+struct EventFilterRule_t;
+
+class CEventSampler
+{
+public:
+    CEventSampler();
+
+    // Held events are discarded; Flush them first to keep them
+    ~CEventSampler();
+
+    // Starts afresh with filter's sample rules, discarding held events
+    void Configure(const CEventFilter& filter);
+
+    // Returns true if this occurrence of rule's event is to be logged, with
+    // the weight it is to carry, or 0 if it is to be held with Hold instead.
+    bool Sample(const EventFilterRule_t& rule, float* pWeight);
+
+    // Adds the weight Sample gave to event, before anything else is added to
+    // it, so that it isn't the key left out if the event fills up.  Reservoir
+    // events get a placeholder that Flush sets.
+    void AddWeight(CEventRecordBuilder& event, const EventFilterRule_t& rule, float weight);
+
+    // Keeps the event a reservoir rule's Sample just chose, in place of any
+    // it replaces, until the round ends.  pRecord must come from GetArenas.
+    void Hold(const EventFilterRule_t& rule, CEventRecord* pRecord);
+    CEventArenas* GetArenas() { return &m_Arenas; }
+
+    // Reservoirs are flushed at the start and end of each round, and should
+    // be flushed on level shutdown and unload too
+    bool HasReservoirs() const { return m_bHasReservoirs; }
+    bool IsRoundBoundary(HKeySymbol event) const;
+    int GetRoundBoundaryCount() const { return m_RoundBoundaries.Count(); }
+    HKeySymbol GetRoundBoundary(int i) const { return m_RoundBoundaries[i]; }
+    void Flush(CEventWriter& writer);
+
+    void PrintStats() const;
+
+private:
+    struct SampleState_t;
+    void Clear();
+    void CountUnweighted(SampleState_t* pState);
+
+    struct SampleState_t
+    {
+        const EventFilterRule_t* m_pRule;
+        int m_nSeen;                // since Configure
+        int m_nKept;
+        double m_flWindowStart;     // rate: the second being counted
+        int m_nWindowSeen;
+        int m_nLastWindowSeen;
+        int m_nRoundSeen;           // reservoir
+        int m_iHoldSlot;            // where Hold puts the event, or -1 to add it
+        int m_nUnweighted;          // logged without sample_weight, for want of a key slot
+        CUtlVector<CEventRecord*> m_Reservoir;
+    };
+
+    CUtlVector<SampleState_t*> m_States;    // by rule index; NULL for rules that don't sample
+    bool m_bHasReservoirs;
+    HKeySymbol m_WeightKey;
+    CUtlVector<HKeySymbol> m_RoundBoundaries;
+    CUniformRandomStream m_Random;
+    CEventArenas m_Arenas;                  // reservoir records, freed once they've been written
+};
+
+#endif // EVENTSAMPLER_H
@@ -0,0 +1,626 @@
+//===========================================================================//
+//
+// Purpose: append-only on-disk spool for events
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include "EventSpool.h"
+#include "EventRecord.h"
+#include "checksum_crc.h"
+#include "convar.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static ConVar eventlogger_spool_segment_size("eventlogger_spool_segment_size", "16384", 0, "Size in KB at which the event spool starts a new segment file", true, 64.0f, false, 0.0f);
+static ConVar eventlogger_spool_fsync("eventlogger_spool_fsync", "1000", 0, "Milliseconds between fsyncs of the event spool; 0 syncs after every write", true, 0.0f, false, 0.0f);
+static ConVar eventlogger_spool_max_size("eventlogger_spool_max_size", "1024", 0, "Disk budget in MB for the event spool; events that don't fit are dropped", true, 1.0f, false, 0.0f);
+
+#define SPOOL_SEGMENT_MAGIC "ELS1"
+#define SPOOL_SEGMENT_HEADER_SIZE 4
+#define SPOOL_RECORD_HEADER_SIZE 8      // payload length + CRC32 of the payload
+#define SPOOL_MAX_RECORD_SIZE (1024 * 1024)
+#define SPOOL_POSITION_FILE "replay.pos"
+#define SPOOL_IDS_ENTRY_SIZE 12         // record offset, Event.Id, GameSessionId
+#define SPOOL_DEAD_LETTER_FILE "deadletter.spool"
+
+static int SegmentCompare(const int* a, const int* b)
+{
+    return *a - *b;
+}
+
+static int SpoolFileSize(const char* pszPath)
+{
+    FILE* f = fopen(pszPath, "rb");
+    if (f == NULL)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    int size = (int)ftell(f);
+    fclose(f);
+    return size;
+}
+
+CEventSpool::CEventSpool()
+    : m_Ids(DefLessFunc(int))
+{
+    m_bInitialized = false;
+    m_szDirectory[0] = '\0';
+    m_nTotalSize = 0;
+    m_bOverBudget = false;
+    m_pWriteFile = NULL;
+    m_nWriteSegment = 0;
+    m_flLastSync = 0.0;
+    m_pReadFile = NULL;
+    m_nReadSegment = 0;
+    m_nReadOffset = 0;
+    m_nPendingOffset = 0;
+    m_bSkipRest = false;
+}
+
+CEventSpool::~CEventSpool()
+{
+    Shutdown();
+}
+
+bool CEventSpool::Init(const char* pszDirectory)
+{
+    Q_strncpy(m_szDirectory, pszDirectory, sizeof(m_szDirectory));
+    m_Segments.RemoveAll();
+    m_SegmentSizes.RemoveAll();
+    m_nTotalSize = 0;
+    m_bOverBudget = false;
+
+#ifdef _WIN32
+    _mkdir(m_szDirectory);
+
+    char pattern[sizeof(m_szDirectory) + 16];
+    Q_snprintf(pattern, sizeof(pattern), "%s\\*.spool", m_szDirectory);
+    _finddata_t fd;
+    intptr_t hFind = _findfirst(pattern, &fd);
+    if (hFind != -1)
+    {
+        do
+        {
+            int segment = atoi(fd.name);
+            if (segment > 0)
+                m_Segments.AddToTail(segment);
+        } while (_findnext(hFind, &fd) == 0);
+        _findclose(hFind);
+    }
+#else
+    mkdir(m_szDirectory, 0755);
+
+    DIR* dir = opendir(m_szDirectory);
+    if (dir == NULL)
+    {
+        Warning("Unable to open event spool directory %s\n", m_szDirectory);
+        return false;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char* ext = strrchr(entry->d_name, '.');
+        int segment = atoi(entry->d_name);
+        if (ext != NULL && strcmp(ext, ".spool") == 0 && segment > 0)
+            m_Segments.AddToTail(segment);
+    }
+    closedir(dir);
+#endif
+
+    m_Segments.Sort(SegmentCompare);
+    for (int i = 0; i < m_Segments.Count(); i++)
+    {
+        char path[sizeof(m_szDirectory) + 16];
+        GetSegmentPath(m_Segments[i], path, sizeof(path));
+        m_SegmentSizes.AddToTail(SpoolFileSize(path));
+        m_nTotalSize += m_SegmentSizes[i];
+    }
+
+    // Never append to a segment from a previous run; its tail may be torn
+    m_nWriteSegment = m_Segments.Count() != 0 ? m_Segments.Tail() + 1 : 1;
+
+    LoadReadPosition();
+
+    if (m_Segments.Count() != 0)
+        Msg("Event spool has %d segments (%d KB) to replay\n", m_Segments.Count(), (int)(m_nTotalSize / 1024));
+
+    m_bInitialized = true;
+    return true;
+}
+
+void CEventSpool::Shutdown()
+{
+    CloseWriteSegment();
+    if (m_pReadFile != NULL)
+    {
+        fclose(m_pReadFile);
+        m_pReadFile = NULL;
+    }
+    m_bInitialized = false;
+}
+
+bool CEventSpool::HasData() const
+{
+    return m_Segments.Count() != 0;
+}
+
+void CEventSpool::GetSegmentPath(int segment, char* pszPath, int maxLen)
+{
+    Q_snprintf(pszPath, maxLen, "%s%c%08d.spool", m_szDirectory, CORRECT_PATH_SEPARATOR, segment);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: frames records into m_Buffer as they are laid out in a segment
+//---------------------------------------------------------------------------------
+void CEventSpool::EncodeRecords(CEventRecord* const* ppRecords, int count)
+{
+    m_Buffer.Clear();
+    for (int i = 0; i < count; i++)
+    {
+        int start = m_Buffer.TellPut();
+        m_Buffer.PutInt(0);
+        m_Buffer.PutUnsignedInt(0);
+        ppRecords[i]->Serialize(m_Buffer);
+
+        unsigned char* pRecord = (unsigned char*)m_Buffer.Base() + start;
+        int length = m_Buffer.TellPut() - start - SPOOL_RECORD_HEADER_SIZE;
+        uint32 crc = (uint32)CRC32_ProcessSingleBuffer(pRecord + SPOOL_RECORD_HEADER_SIZE, length);
+        memcpy(pRecord, &length, 4);
+        memcpy(pRecord + 4, &crc, 4);
+    }
+}
+
+bool CEventSpool::Append(CEventRecord* const* ppRecords, int count)
+{
+    if (!m_bInitialized)
+        return false;
+
+    EncodeRecords(ppRecords, count);
+
+    int64 budget = (int64)eventlogger_spool_max_size.GetInt() * 1024 * 1024;
+    if (m_nTotalSize + m_Buffer.TellPut() > budget)
+    {
+        if (!m_bOverBudget)
+            Warning("Event spool is over its %d MB budget; dropping events until it drains\n", eventlogger_spool_max_size.GetInt());
+        m_bOverBudget = true;
+        return false;
+    }
+    m_bOverBudget = false;
+
+    int segmentLimit = eventlogger_spool_segment_size.GetInt() * 1024;
+    if (m_pWriteFile != NULL && m_SegmentSizes.Tail() + m_Buffer.TellPut() > segmentLimit)
+        CloseWriteSegment();
+    if (m_pWriteFile == NULL && !OpenWriteSegment())
+        return false;
+
+    if (fwrite(m_Buffer.Base(), 1, m_Buffer.TellPut(), m_pWriteFile) != (size_t)m_Buffer.TellPut() || fflush(m_pWriteFile) != 0)
+    {
+        // Whatever made it to disk fails its CRC on replay; start over in a new segment
+        Warning("Write to event spool segment %d failed\n", m_nWriteSegment);
+        CloseWriteSegment();
+        return false;
+    }
+
+    m_SegmentSizes.Tail() += m_Buffer.TellPut();
+    m_nTotalSize += m_Buffer.TellPut();
+    Sync(false);
+    return true;
+}
+
+bool CEventSpool::OpenWriteSegment()
+{
+    char path[sizeof(m_szDirectory) + 16];
+    GetSegmentPath(m_nWriteSegment, path, sizeof(path));
+
+    m_pWriteFile = fopen(path, "wb");
+    if (m_pWriteFile == NULL || fwrite(SPOOL_SEGMENT_MAGIC, 1, SPOOL_SEGMENT_HEADER_SIZE, m_pWriteFile) != SPOOL_SEGMENT_HEADER_SIZE)
+    {
+        Warning("Unable to create event spool segment %s\n", path);
+        if (m_pWriteFile != NULL)
+        {
+            fclose(m_pWriteFile);
+            m_pWriteFile = NULL;
+        }
+        return false;
+    }
+
+    m_Segments.AddToTail(m_nWriteSegment);
+    m_SegmentSizes.AddToTail(SPOOL_SEGMENT_HEADER_SIZE);
+    m_nTotalSize += SPOOL_SEGMENT_HEADER_SIZE;
+    m_flLastSync = Plat_FloatTime();
+    return true;
+}
+
+void CEventSpool::CloseWriteSegment()
+{
+    if (m_pWriteFile == NULL)
+        return;
+
+    Sync(true);
+    fclose(m_pWriteFile);
+    m_pWriteFile = NULL;
+    m_nWriteSegment++;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: flushes the write segment to disk, at most once every
+//          eventlogger_spool_fsync milliseconds unless bForce is set
+//---------------------------------------------------------------------------------
+void CEventSpool::Sync(bool bForce)
+{
+    double now = Plat_FloatTime();
+    if (!bForce && (now - m_flLastSync) * 1000.0 < eventlogger_spool_fsync.GetFloat())
+        return;
+
+    fflush(m_pWriteFile);
+#ifdef _WIN32
+    _commit(_fileno(m_pWriteFile));
+#else
+    fsync(fileno(m_pWriteFile));
+#endif
+    m_flLastSync = now;
+}
+
+int CEventSpool::Read(CUtlVector<CEventRecord*>& records, int maxCount)
+{
+    CEventRecordBuilder builder;
+    int count = 0;
+    m_ReadOffsets.RemoveAll();
+    while (count == 0 && m_Segments.Count() != 0)
+    {
+        if (m_pReadFile == NULL && !OpenReadSegment())
+        {
+            FinishReadSegment();
+            continue;
+        }
+
+        // Start from the committed position, so anything read but not committed is read again
+        bool bWriteSegment = (m_pWriteFile != NULL && m_nReadSegment == m_nWriteSegment);
+        int segmentSize = m_SegmentSizes[0];
+        m_nPendingOffset = m_nReadOffset;
+        fseek(m_pReadFile, m_nPendingOffset, SEEK_SET);
+
+        bool bCorrupt = false;
+        while (count < maxCount && m_nPendingOffset + SPOOL_RECORD_HEADER_SIZE <= segmentSize)
+        {
+            int length;
+            uint32 crc;
+            if (fread(&length, 4, 1, m_pReadFile) != 1 || fread(&crc, 4, 1, m_pReadFile) != 1 ||
+                length <= 0 || length > SPOOL_MAX_RECORD_SIZE || m_nPendingOffset + SPOOL_RECORD_HEADER_SIZE + length > segmentSize)
+            {
+                bCorrupt = true;
+                break;
+            }
+
+            m_Buffer.Clear();
+            m_Buffer.EnsureCapacity(length);
+            if (fread(m_Buffer.Base(), 1, length, m_pReadFile) != (size_t)length ||
+                (uint32)CRC32_ProcessSingleBuffer(m_Buffer.Base(), length) != crc)
+            {
+                bCorrupt = true;
+                break;
+            }
+            m_Buffer.SeekPut(CUtlBuffer::SEEK_HEAD, length);
+
+            if (!builder.Unserialize(m_Buffer))
+            {
+                bCorrupt = true;
+                break;
+            }
+
+            // Replayed records come from the heap; the arenas belong to the game thread
+            CEventRecord* pRecord = builder.Finish(NULL);
+            int ids = m_Ids.Find(m_nPendingOffset);
+            if (m_Ids.IsValidIndex(ids))
+            {
+                pRecord->SetEventId(m_Ids[ids].m_iEventId);
+                pRecord->SetGameSessionId(m_Ids[ids].m_iGameSessionId);
+            }
+            records.AddToTail(pRecord);
+            m_ReadOffsets.AddToTail(m_nPendingOffset);
+            count++;
+            m_nPendingOffset += SPOOL_RECORD_HEADER_SIZE + length;
+        }
+
+        if (bCorrupt)
+        {
+            // Nothing after a bad record can be trusted to be framed correctly
+            Warning("Event spool segment %d is corrupt at offset %d; skipping the rest of it\n", m_nReadSegment, m_nPendingOffset);
+            if (bWriteSegment)
+                CloseWriteSegment();
+            m_bSkipRest = true;
+            bWriteSegment = false;
+        }
+
+        if (count == 0)
+        {
+            // Caught up with the segment still being written; nothing more to read yet
+            if (bWriteSegment)
+                break;
+            FinishReadSegment();
+        }
+    }
+    return count;
+}
+
+void CEventSpool::Commit()
+{
+    if (m_pReadFile == NULL)
+        return;
+
+    m_nReadOffset = m_nPendingOffset;
+    if (m_nReadOffset < m_SegmentSizes[0] && !m_bSkipRest)
+    {
+        SaveReadPosition();
+        return;
+    }
+
+    // The whole segment has been replayed
+    if (m_pWriteFile != NULL && m_nReadSegment == m_nWriteSegment)
+        CloseWriteSegment();
+    FinishReadSegment();
+}
+
+bool CEventSpool::OpenReadSegment()
+{
+    m_nReadSegment = m_Segments[0];
+
+    char path[sizeof(m_szDirectory) + 16];
+    GetSegmentPath(m_nReadSegment, path, sizeof(path));
+
+    m_pReadFile = fopen(path, "rb");
+    if (m_pReadFile == NULL)
+    {
+        Warning("Unable to open event spool segment %s\n", path);
+        return false;
+    }
+
+    char magic[SPOOL_SEGMENT_HEADER_SIZE];
+    if (fread(magic, 1, SPOOL_SEGMENT_HEADER_SIZE, m_pReadFile) != SPOOL_SEGMENT_HEADER_SIZE ||
+        memcmp(magic, SPOOL_SEGMENT_MAGIC, SPOOL_SEGMENT_HEADER_SIZE) != 0)
+    {
+        Warning("Event spool segment %s has a bad header; skipping it\n", path);
+        fclose(m_pReadFile);
+        m_pReadFile = NULL;
+        return false;
+    }
+
+    if (m_nReadOffset < SPOOL_SEGMENT_HEADER_SIZE)
+        m_nReadOffset = SPOOL_SEGMENT_HEADER_SIZE;
+    m_nPendingOffset = m_nReadOffset;
+    LoadIds();
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: deletes the oldest segment once it has been replayed (or can't be)
+//---------------------------------------------------------------------------------
+void CEventSpool::FinishReadSegment()
+{
+    if (m_pReadFile != NULL)
+    {
+        fclose(m_pReadFile);
+        m_pReadFile = NULL;
+    }
+
+    char path[sizeof(m_szDirectory) + 16];
+    GetSegmentPath(m_Segments[0], path, sizeof(path));
+    remove(path);
+    GetIdsPath(m_Segments[0], path, sizeof(path));
+    remove(path);
+    m_Ids.RemoveAll();
+    m_ReadOffsets.RemoveAll();
+
+    m_nTotalSize -= m_SegmentSizes[0];
+    m_Segments.Remove(0);
+    m_SegmentSizes.Remove(0);
+    m_nReadOffset = 0;
+    m_nPendingOffset = 0;
+    m_bSkipRest = false;
+
+    if (m_Segments.Count() != 0)
+    {
+        SaveReadPosition();
+    }
+    else
+    {
+        char posPath[sizeof(m_szDirectory) + 16];
+        Q_snprintf(posPath, sizeof(posPath), "%s%c%s", m_szDirectory, CORRECT_PATH_SEPARATOR, SPOOL_POSITION_FILE);
+        remove(posPath);
+        m_nTotalSize = 0;
+    }
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: the replay position is kept in a small side file so that a restart
+//          doesn't replay events from the oldest segment a second time
+//---------------------------------------------------------------------------------
+void CEventSpool::SaveReadPosition()
+{
+    char path[sizeof(m_szDirectory) + 16];
+    Q_snprintf(path, sizeof(path), "%s%c%s", m_szDirectory, CORRECT_PATH_SEPARATOR, SPOOL_POSITION_FILE);
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return;
+    fprintf(f, "%d %d\n", m_Segments.Count() != 0 ? m_Segments[0] : 0, m_nReadOffset);
+    fclose(f);
+}
+
+void CEventSpool::LoadReadPosition()
+{
+    m_nReadOffset = 0;
+
+    char path[sizeof(m_szDirectory) + 16];
+    Q_snprintf(path, sizeof(path), "%s%c%s", m_szDirectory, CORRECT_PATH_SEPARATOR, SPOOL_POSITION_FILE);
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return;
+
+    int segment, offset;
+    if (fscanf(f, "%d %d", &segment, &offset) == 2 && m_Segments.Count() != 0 && segment == m_Segments[0] &&
+        offset > 0 && offset <= m_SegmentSizes[0])
+    {
+        m_nReadOffset = offset;
+    }
+    fclose(f);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: records spooled before the writer ever tried to write them have no
+//          ids yet.  The ids they are given on replay are appended to a side
+//          file next to their segment, one fsynced block per Read, since the
+//          segment itself is never rewritten.
+//---------------------------------------------------------------------------------
+void CEventSpool::GetIdsPath(int segment, char* pszPath, int maxLen)
+{
+    Q_snprintf(pszPath, maxLen, "%s%c%08d.ids", m_szDirectory, CORRECT_PATH_SEPARATOR, segment);
+}
+
+bool CEventSpool::SaveIds(CEventRecord* const* ppRecords, int count)
+{
+    Assert(count == m_ReadOffsets.Count());
+    if (m_pReadFile == NULL || count != m_ReadOffsets.Count())
+        return false;
+
+    // Block of count entries followed by their CRC32, so a torn block is ignored
+    m_Buffer.Clear();
+    m_Buffer.PutInt(count);
+    for (int i = 0; i < count; i++)
+    {
+        m_Buffer.PutInt(m_ReadOffsets[i]);
+        m_Buffer.PutInt(ppRecords[i]->GetEventId());
+        m_Buffer.PutInt(ppRecords[i]->GetGameSessionId());
+    }
+    uint32 crc = (uint32)CRC32_ProcessSingleBuffer(m_Buffer.Base(), m_Buffer.TellPut());
+    m_Buffer.PutUnsignedInt(crc);
+
+    char path[sizeof(m_szDirectory) + 16];
+    GetIdsPath(m_nReadSegment, path, sizeof(path));
+
+    FILE* f = fopen(path, "ab");
+    if (f == NULL)
+    {
+        Warning("Unable to open event spool id file %s\n", path);
+        return false;
+    }
+
+    bool bSaved = fwrite(m_Buffer.Base(), 1, m_Buffer.TellPut(), f) == (size_t)m_Buffer.TellPut() && fflush(f) == 0;
+#ifdef _WIN32
+    bSaved = bSaved && _commit(_fileno(f)) == 0;
+#else
+    bSaved = bSaved && fsync(fileno(f)) == 0;
+#endif
+    fclose(f);
+    if (!bSaved)
+    {
+        Warning("Write to event spool id file %s failed\n", path);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        SpoolIds_t ids;
+        ids.m_iEventId = ppRecords[i]->GetEventId();
+        ids.m_iGameSessionId = ppRecords[i]->GetGameSessionId();
+        m_Ids.InsertOrReplace(m_ReadOffsets[i], ids);
+    }
+    return true;
+}
+
+void CEventSpool::LoadIds()
+{
+    m_Ids.RemoveAll();
+
+    char path[sizeof(m_szDirectory) + 16];
+    GetIdsPath(m_nReadSegment, path, sizeof(path));
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return;
+
+    int count;
+    while (fread(&count, 4, 1, f) == 1)
+    {
+        if (count <= 0 || count > SPOOL_MAX_RECORD_SIZE / SPOOL_IDS_ENTRY_SIZE)
+            break;
+
+        int length = 4 + count * SPOOL_IDS_ENTRY_SIZE;
+        m_Buffer.Clear();
+        m_Buffer.EnsureCapacity(length);
+        memcpy(m_Buffer.Base(), &count, 4);
+
+        uint32 crc;
+        if (fread((unsigned char*)m_Buffer.Base() + 4, 1, length - 4, f) != (size_t)(length - 4) ||
+            fread(&crc, 4, 1, f) != 1 ||
+            (uint32)CRC32_ProcessSingleBuffer(m_Buffer.Base(), length) != crc)
+        {
+            // Torn by a crash before the write it guarded was attempted
+            break;
+        }
+
+        const int* pEntries = (const int*)((unsigned char*)m_Buffer.Base() + 4);
+        for (int i = 0; i < count; i++)
+        {
+            SpoolIds_t ids;
+            ids.m_iEventId = pEntries[i * 3 + 1];
+            ids.m_iGameSessionId = pEntries[i * 3 + 2];
+            m_Ids.InsertOrReplace(pEntries[i * 3], ids);
+        }
+    }
+    fclose(f);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: the dead-letter file has the same layout as a segment, but isn't
+//          numbered, so it is never replayed or counted against the budget.
+//          Renaming it to a number above the newest segment replays it.
+//---------------------------------------------------------------------------------
+bool CEventSpool::DeadLetter(CEventRecord* const* ppRecords, int count)
+{
+    if (m_pReadFile == NULL)
+        return false;
+
+    char path[sizeof(m_szDirectory) + 24];
+    Q_snprintf(path, sizeof(path), "%s%c%s", m_szDirectory, CORRECT_PATH_SEPARATOR, SPOOL_DEAD_LETTER_FILE);
+
+    bool bNew = (SpoolFileSize(path) == 0);
+    FILE* f = fopen(path, "ab");
+    if (f == NULL)
+    {
+        Warning("Unable to open event spool dead-letter file %s\n", path);
+        return false;
+    }
+
+    EncodeRecords(ppRecords, count);
+    bool bSaved = (!bNew || fwrite(SPOOL_SEGMENT_MAGIC, 1, SPOOL_SEGMENT_HEADER_SIZE, f) == SPOOL_SEGMENT_HEADER_SIZE) &&
+        fwrite(m_Buffer.Base(), 1, m_Buffer.TellPut(), f) == (size_t)m_Buffer.TellPut() && fflush(f) == 0;
+#ifdef _WIN32
+    bSaved = bSaved && _commit(_fileno(f)) == 0;
+#else
+    bSaved = bSaved && fsync(fileno(f)) == 0;
+#endif
+    fclose(f);
+    if (!bSaved)
+    {
+        Warning("Write to event spool dead-letter file %s failed\n", path);
+        return false;
+    }
+
+    Commit();
+    return true;
+}
@@ -0,0 +1,110 @@
+//===========================================================================//
+//
+// Purpose: append-only on-disk spool for events that can't be written to the
+//          stats database right away.  The spool is a directory of numbered
+//          segment files; each record in a segment carries its length and a
+//          CRC32 so that a torn write at the end of a segment is detected on
+//          replay rather than replayed as garbage.
+//
+//          Only the writer thread uses the spool.
+//
+//===========================================================================//
+
+#ifndef EVENTSPOOL_H
+#define EVENTSPOOL_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <stdio.h>
+
+#include "utlbuffer.h"
+#include "utlmap.h"
+#include "utlvector.h"
+
+class CEventRecord;
+
+class CEventSpool
+{
+public:
+    CEventSpool();
+    ~CEventSpool();
+
+    // Opens the spool directory, creating it if needed, and picks up any
+    // segments left over from a previous run.
+    bool Init(const char* pszDirectory);
+    void Shutdown();
+
+    // True while there are spooled events that haven't been replayed.
+    bool HasData() const;
+
+    // Appends records to the newest segment.  Returns false if the disk budget
+    // is used up or the write failed, in which case nothing was appended.
+    bool Append(CEventRecord* const* ppRecords, int count);
+
+    // Reads up to maxCount of the oldest spooled records into records; the
+    // caller owns them.  They are read again by the next Read unless Commit is
+    // called first.
+    int Read(CUtlVector<CEventRecord*>& records, int maxCount);
+
+    // Marks the records returned by the last Read as written.
+    void Commit();
+
+    // Saves the Event.Id and GameSessionId the writer gave the records returned
+    // by the last Read, so that the next Read of them gives them the same ids
+    // again.  Must succeed before the records are first written, so that a
+    // retry after an unanswered COMMIT skips rows that were written rather
+    // than duplicating them.
+    bool SaveIds(CEventRecord* const* ppRecords, int count);
+
+    // Moves the records returned by the last Read, which the writer has given
+    // up on, to the dead-letter file and commits them.  Returns false if they
+    // could not be saved there.
+    bool DeadLetter(CEventRecord* const* ppRecords, int count);
+
+private:
+    void GetSegmentPath(int segment, char* pszPath, int maxLen);
+    void EncodeRecords(CEventRecord* const* ppRecords, int count);
+    bool OpenWriteSegment();
+    void CloseWriteSegment();
+    bool OpenReadSegment();
+    void FinishReadSegment();
+    void Sync(bool bForce);
+    void SaveReadPosition();
+    void LoadReadPosition();
+    void GetIdsPath(int segment, char* pszPath, int maxLen);
+    void LoadIds();
+
+    bool m_bInitialized;
+    char m_szDirectory[260];
+
+    // Segment numbers on disk, oldest first, and their sizes in bytes
+    CUtlVector<int> m_Segments;
+    CUtlVector<int> m_SegmentSizes;
+    int64 m_nTotalSize;
+    bool m_bOverBudget;
+
+    FILE* m_pWriteFile;
+    int m_nWriteSegment;
+    double m_flLastSync;
+
+    FILE* m_pReadFile;
+    int m_nReadSegment;
+    int m_nReadOffset;          // committed position in the read segment
+    int m_nPendingOffset;       // position after the last Read
+    bool m_bSkipRest;           // the read segment is corrupt past m_nPendingOffset
+
+    // Ids saved for records in the read segment, by offset, and the offsets of
+    // the records returned by the last Read
+    struct SpoolIds_t
+    {
+        int m_iEventId;
+        int m_iGameSessionId;
+    };
+    CUtlMap<int, SpoolIds_t> m_Ids;
+    CUtlVector<int> m_ReadOffsets;
+
+    CUtlBuffer m_Buffer;
+};
+
+#endif // EVENTSPOOL_H
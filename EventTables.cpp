@@ -0,0 +1,421 @@
+//===========================================================================//
+//
+// Purpose: typed per-event tables
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "EventTables.h"
+#include "EventDescriptors.h"
+#include "EventRecord.h"
+#include "utlbuffer.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// SQLSTATE for ALTER TABLE ... ADD COLUMN of a column that already exists,
+// eg. because another server sharing the database added it first
+#define SQLSTATE_DUPLICATE_COLUMN "42701"
+
+static const char* SqlType(KeyValues::types_t type)
+{
+    switch (type)
+    {
+    case KeyValues::TYPE_INT: return "INT4";
+    case KeyValues::TYPE_FLOAT: return "FLOAT8";
+    case KeyValues::TYPE_UINT64: return "INT8";
+    default: return "TEXT";
+    }
+}
+
+// The type a column has in the database, going by information_schema's data_type
+static KeyValues::types_t ColumnType(const char* dataType)
+{
+    if (Q_strcmp(dataType, "integer") == 0 || Q_strcmp(dataType, "smallint") == 0)
+        return KeyValues::TYPE_INT;
+    if (Q_strcmp(dataType, "double precision") == 0 || Q_strcmp(dataType, "real") == 0 || Q_strcmp(dataType, "numeric") == 0)
+        return KeyValues::TYPE_FLOAT;
+    if (Q_strcmp(dataType, "bigint") == 0)
+        return KeyValues::TYPE_UINT64;
+    return KeyValues::TYPE_STRING;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: turns an event or key name into something that is safe to use as a
+//          quoted SQL identifier and that matches its name in the catalog
+//---------------------------------------------------------------------------------
+static void MakeIdentifier(char* out, int maxLen, const char* prefix, const char* name)
+{
+    int len = Q_snprintf(out, maxLen, "%s", prefix);
+    for (const char* p = name; *p != '\0' && len < maxLen - 1; p++)
+        out[len++] = isalnum((unsigned char)*p) ? (char)tolower((unsigned char)*p) : '_';
+    out[len] = '\0';
+}
+
+CEventTables::CEventTables()
+    : m_TableIndex(k_eDictCompareTypeCaseSensitive)
+{
+}
+
+CEventTables::~CEventTables()
+{
+    for (int i = 0; i < m_Tables.Count(); i++)
+    {
+        EventTable_t* pTable = m_Tables[i];
+        for (int j = 0; j < pTable->m_Columns.Count(); j++)
+        {
+            free(pTable->m_Columns[j].m_pszKey);
+            free(pTable->m_Columns[j].m_pszColumn);
+        }
+        free(pTable->m_pszEvent);
+        if (pTable->m_pszCopyColumns != NULL)
+            free(pTable->m_pszCopyColumns);
+    }
+    m_Tables.PurgeAndDeleteElements();
+}
+
+void CEventTables::LoadDescriptors(const CEventDescriptors& descriptors)
+{
+    for (int i = 0; i < descriptors.GetCount(); i++)
+    {
+        const EventDescriptor_t& event = descriptors.Get(i);
+        int index = m_TableIndex.Find(event.m_pszName);
+        EventTable_t* pTable = index != m_TableIndex.InvalidIndex() ? m_Tables[m_TableIndex[index]] : AddTable(event.m_pszName);
+
+        for (int j = 0; j < event.m_Keys.Count(); j++)
+        {
+            // "local" keys aren't networked and have no declared type;
+            // they get a column from their value when first seen.
+            if (event.m_Keys[j].m_Type != KeyValues::TYPE_NONE)
+                AddColumn(pTable, event.m_Keys[j].m_pszName, event.m_Keys[j].m_Type);
+        }
+    }
+}
+
+void CEventTables::Reset()
+{
+    for (int i = 0; i < m_Tables.Count(); i++)
+    {
+        m_Tables[i]->m_bChecked = false;
+        for (int j = 0; j < m_Tables[i]->m_Columns.Count(); j++)
+            m_Tables[i]->m_Columns[j].m_bExists = false;
+    }
+}
+
+int CEventTables::Prepare(PGconn* db, const CEventRecord* pRecord)
+{
+    int index = m_TableIndex.Find(pRecord->GetName());
+    if (index != m_TableIndex.InvalidIndex())
+    {
+        index = m_TableIndex[index];
+    }
+    else
+    {
+        AddTable(pRecord->GetName());
+        index = m_Tables.Count() - 1;
+    }
+    EventTable_t* pTable = m_Tables[index];
+
+    for (int i = 0; i < pRecord->GetKeyCount(); i++)
+        AddColumn(pTable, pRecord->GetKeyName(i), pRecord->GetKey(i).m_Type);
+
+    if (!pTable->m_bChecked && !CheckTable(db, pTable))
+        return -1;
+    if (!AddMissingColumns(db, pTable))
+        return -1;
+    return index;
+}
+
+int CEventTables::FindKey(const CEventRecord* pRecord, const EventColumn_t& column)
+{
+    for (int i = 0; i < pRecord->GetKeyCount(); i++)
+    {
+        if (Q_stricmp(pRecord->GetKeyName(i), column.m_pszKey) == 0)
+            return i;
+    }
+    return -1;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: a key that isn't described takes the type of the first value seen,
+//          so later events may send another type.  Numbers are converted when
+//          they fit; anything can be written to a TEXT column.
+//---------------------------------------------------------------------------------
+bool CEventTables::ConvertValue(const EventRecordKey_t& value, KeyValues::types_t type, char* out, int maxLen)
+{
+    // The value as a number, if it is one
+    double number;
+    bool bIntegral;
+    switch (value.m_Type)
+    {
+    case KeyValues::TYPE_INT:
+        number = value.m_iValue;
+        bIntegral = true;
+        break;
+    case KeyValues::TYPE_FLOAT:
+        number = value.m_flValue;
+        bIntegral = (floor(number) == number);
+        break;
+    case KeyValues::TYPE_UINT64:
+        number = (double)value.m_ulValue;
+        bIntegral = true;
+        break;
+    case KeyValues::TYPE_STRING:
+    {
+        if (type == KeyValues::TYPE_STRING)
+            return false;
+        char* end;
+        errno = 0;
+        number = strtod(value.m_pszValue, &end);
+        if (end == value.m_pszValue || *end != '\0' || errno != 0)
+            return false;
+        bIntegral = (floor(number) == number);
+        break;
+    }
+    default:
+        return false;
+    }
+
+    switch (type)
+    {
+    case KeyValues::TYPE_STRING:
+        if (value.m_Type == KeyValues::TYPE_INT)
+            Q_snprintf(out, maxLen, "%d", value.m_iValue);
+        else if (value.m_Type == KeyValues::TYPE_UINT64)
+            Q_snprintf(out, maxLen, "%llu", (unsigned long long)value.m_ulValue);
+        else
+            Q_snprintf(out, maxLen, "%.9g", number);
+        return true;
+    case KeyValues::TYPE_INT:
+        if (!bIntegral || number < INT_MIN || number > INT_MAX)
+            return false;
+        Q_snprintf(out, maxLen, "%d", (int)number);
+        return true;
+    case KeyValues::TYPE_FLOAT:
+        Q_snprintf(out, maxLen, "%.17g", number);
+        return true;
+    case KeyValues::TYPE_UINT64:
+        // INT8 is signed
+        if (value.m_Type == KeyValues::TYPE_UINT64)
+        {
+            if (value.m_ulValue > (uint64)LLONG_MAX)
+                return false;
+            Q_snprintf(out, maxLen, "%llu", (unsigned long long)value.m_ulValue);
+            return true;
+        }
+        if (value.m_Type == KeyValues::TYPE_STRING)
+        {
+            // Past 2^53 a double can't hold every integer
+            char* end;
+            errno = 0;
+            long long integer = strtoll(value.m_pszValue, &end, 10);
+            if (end == value.m_pszValue || *end != '\0' || errno != 0)
+                return false;
+            Q_snprintf(out, maxLen, "%lld", integer);
+            return true;
+        }
+        if (!bIntegral || number < -9.2e18 || number > 9.2e18)
+            return false;
+        Q_snprintf(out, maxLen, "%lld", (long long)number);
+        return true;
+    default:
+        return false;
+    }
+}
+
+EventTable_t* CEventTables::AddTable(const char* pszEvent)
+{
+    EventTable_t* pTable = new EventTable_t;
+    pTable->m_pszEvent = strdup(pszEvent);
+    MakeIdentifier(pTable->m_szTable, sizeof(pTable->m_szTable), "ev_", pszEvent);
+    pTable->m_bChecked = false;
+    pTable->m_pszCopyColumns = NULL;
+
+    m_TableIndex.Insert(pszEvent, m_Tables.AddToTail(pTable));
+    return pTable;
+}
+
+int CEventTables::AddColumn(EventTable_t* pTable, const char* pszKey, KeyValues::types_t type)
+{
+    for (int i = 0; i < pTable->m_Columns.Count(); i++)
+    {
+        if (Q_stricmp(pTable->m_Columns[i].m_pszKey, pszKey) == 0)
+            return i;
+    }
+
+    // Keep clear of the columns every table has
+    char column[64];
+    MakeIdentifier(column, sizeof(column), "", pszKey);
+    if (Q_strcmp(column, "eventid") == 0 || Q_strcmp(column, "gamesessionid") == 0 || Q_strcmp(column, "datetime") == 0 ||
+        Q_strcmp(column, "tick") == 0 || Q_strcmp(column, "curtimems") == 0 || Q_strcmp(column, "monotonicus") == 0 ||
+        Q_strcmp(column, "seq") == 0)
+        MakeIdentifier(column, sizeof(column), "key_", pszKey);
+
+    // Keys that only differ in case or punctuation, eg. "Foo-Bar" and
+    // "foo_bar", would otherwise share a column and be named twice in COPY
+    if (FindColumn(pTable, column) != -1)
+    {
+        char base[64];
+        Q_strncpy(base, column, sizeof(base));
+        for (int n = 2; FindColumn(pTable, column) != -1; n++)
+        {
+            char suffix[16];
+            int suffixLen = Q_snprintf(suffix, sizeof(suffix), "_%d", n);
+            int baseLen = min((int)strlen(base), (int)sizeof(column) - 1 - suffixLen);
+            Q_snprintf(column, sizeof(column), "%.*s%s", baseLen, base, suffix);
+        }
+    }
+
+    EventColumn_t col;
+    col.m_pszKey = strdup(pszKey);
+    col.m_pszColumn = strdup(column);
+    col.m_Type = type;
+    col.m_bExists = false;
+    col.m_bWarnedType = false;
+    return pTable->m_Columns.AddToTail(col);
+}
+
+int CEventTables::FindColumn(const EventTable_t* pTable, const char* pszColumn)
+{
+    for (int i = 0; i < pTable->m_Columns.Count(); i++)
+    {
+        if (Q_strcmp(pTable->m_Columns[i].m_pszColumn, pszColumn) == 0)
+            return i;
+    }
+    return -1;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: finds out which of a table's columns already exist, creating the
+//          table if it doesn't exist at all
+//---------------------------------------------------------------------------------
+bool CEventTables::CheckTable(PGconn* db, EventTable_t* pTable)
+{
+    const char* const values[] = { pTable->m_szTable };
+
+    // A second pass covers another server creating the table at the same time.
+    // Only the schema CREATE TABLE would use counts; a same-named table
+    // elsewhere must not stand in for this one.
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        PGresult* res = PQexecParams(db, "SELECT column_name, data_type FROM information_schema.columns WHERE table_name = $1 AND table_schema = current_schema()",
+            1, NULL, values, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        {
+            Warning("Reading the columns of %s failed: %s", pTable->m_szTable, PQerrorMessage(db));
+            PQclear(res);
+            return false;
+        }
+
+        int rows = PQntuples(res);
+        bool bSeqColumn = false;
+        for (int i = 0; i < rows; i++)
+        {
+            const char* name = PQgetvalue(res, i, 0);
+            if (Q_strcmp(name, "seq") == 0)
+                bSeqColumn = true;
+            for (int j = 0; j < pTable->m_Columns.Count(); j++)
+            {
+                // Whoever created the column decided its type, maybe from
+                // another type of value than this server saw first
+                if (Q_strcmp(pTable->m_Columns[j].m_pszColumn, name) == 0)
+                {
+                    pTable->m_Columns[j].m_bExists = true;
+                    pTable->m_Columns[j].m_Type = ColumnType(PQgetvalue(res, i, 1));
+                }
+            }
+        }
+        PQclear(res);
+
+        char sql[512];
+        if (rows != 0)
+        {
+            // Tables created before events carried their capture time and Seq
+            if (!bSeqColumn)
+            {
+                Q_snprintf(sql, sizeof(sql),
+                    "ALTER TABLE \"%s\" ADD COLUMN IF NOT EXISTS Tick INT4, ADD COLUMN IF NOT EXISTS CurTimeMs INT4,"
+                    " ADD COLUMN IF NOT EXISTS MonotonicUs INT8, ADD COLUMN IF NOT EXISTS Seq INT8",
+                    pTable->m_szTable);
+                res = PQexec(db, sql);
+                ExecStatusType resStatus = PQresultStatus(res);
+                PQclear(res);
+                if (resStatus != PGRES_COMMAND_OK)
+                {
+                    Warning("\"%s\" failed: %s", sql, PQerrorMessage(db));
+                    return false;
+                }
+            }
+            pTable->m_bChecked = true;
+            return true;
+        }
+
+        Q_snprintf(sql, sizeof(sql),
+            "CREATE TABLE \"%s\" (EventId INT4 PRIMARY KEY, GameSessionId INT4 REFERENCES GameSession (Id) NOT NULL, DateTime TIMESTAMP DEFAULT NOW() NOT NULL,"
+            " Tick INT4, CurTimeMs INT4, MonotonicUs INT8, Seq INT8)",
+            pTable->m_szTable);
+        res = PQexec(db, sql);
+        ExecStatusType resStatus = PQresultStatus(res);
+        PQclear(res);
+        if (resStatus == PGRES_COMMAND_OK)
+        {
+            Msg("Created table %s\n", pTable->m_szTable);
+            pTable->m_bChecked = true;
+            return true;
+        }
+    }
+
+    Warning("Creating table %s failed: %s", pTable->m_szTable, PQerrorMessage(db));
+    return false;
+}
+
+bool CEventTables::AddMissingColumns(PGconn* db, EventTable_t* pTable)
+{
+    bool bChanged = (pTable->m_pszCopyColumns == NULL);
+    for (int i = 0; i < pTable->m_Columns.Count(); i++)
+    {
+        EventColumn_t& column = pTable->m_Columns[i];
+        if (column.m_bExists)
+            continue;
+
+        char sql[256];
+        Q_snprintf(sql, sizeof(sql), "ALTER TABLE \"%s\" ADD COLUMN \"%s\" %s", pTable->m_szTable, column.m_pszColumn, SqlType(column.m_Type));
+        PGresult* res = PQexec(db, sql);
+        ExecStatusType resStatus = PQresultStatus(res);
+        const char* sqlState = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        bool bDuplicate = (sqlState != NULL && strcmp(sqlState, SQLSTATE_DUPLICATE_COLUMN) == 0);
+        PQclear(res);
+        if (resStatus != PGRES_COMMAND_OK && !bDuplicate)
+        {
+            Warning("\"%s\" failed: %s", sql, PQerrorMessage(db));
+            return false;
+        }
+
+        column.m_bExists = true;
+        bChanged = true;
+    }
+
+    if (bChanged)
+        BuildCopyColumns(pTable);
+    return true;
+}
+
+void CEventTables::BuildCopyColumns(EventTable_t* pTable)
+{
+    CUtlBuffer columns(0, 0, CUtlBuffer::TEXT_BUFFER);
+    columns.Printf("EventId, GameSessionId, DateTime, Tick, CurTimeMs, MonotonicUs, Seq");
+    for (int i = 0; i < pTable->m_Columns.Count(); i++)
+        columns.Printf(", \"%s\"", pTable->m_Columns[i].m_pszColumn);
+    columns.PutChar('\0');
+
+    if (pTable->m_pszCopyColumns != NULL)
+        free(pTable->m_pszCopyColumns);
+    pTable->m_pszCopyColumns = strdup((const char*)columns.Base());
+}
@@ -0,0 +1,90 @@
+//===========================================================================//
+//
+// Purpose: typed per-event tables for the "wide" eventlogger_storage
+//          mode, where each event is one row of a table such as
+//          ev_player_death (EventId, GameSessionId, DateTime, attacker,
+//          userid, weapon, ...) rather than one EventData row per key.
+//
+//          Column types come from the game's event descriptions.  Keys that
+//          aren't described there are added with ALTER TABLE when first seen.
+//
+//===========================================================================//
+
+#ifndef EVENTTABLES_H
+#define EVENTTABLES_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "KeyValues.h"
+#include "utldict.h"
+#include "utlvector.h"
+
+#include "libpq-fe.h"
+
+class CEventDescriptors;
+class CEventRecord;
+struct EventRecordKey_t;
+
+struct EventColumn_t
+{
+    char* m_pszKey;                 // key name as it appears in the event
+    char* m_pszColumn;              // key name lower-cased, other characters made '_',
+                                    // and suffixed _2, _3, ... if another key had it
+    KeyValues::types_t m_Type;      // TYPE_STRING, TYPE_INT, TYPE_FLOAT or TYPE_UINT64, as
+                                    // the column is in the database once it exists
+    bool m_bExists;                 // known to exist in the database
+    mutable bool m_bWarnedType;     // a value that doesn't fit m_Type has been reported
+};
+
+struct EventTable_t
+{
+    char* m_pszEvent;
+    char m_szTable[64];             // "ev_" and the lower-cased event name
+    CUtlVector<EventColumn_t> m_Columns;
+    bool m_bChecked;                // m_Columns[i].m_bExists is up to date
+    char* m_pszCopyColumns;         // for COPY, and INSERT ... SELECT when a batch is written again
+};
+
+class CEventTables
+{
+public:
+    CEventTables();
+    ~CEventTables();
+
+    // Registers a table, with a column for each typed key, for each of the
+    // game's event descriptions; nothing is created in the database until
+    // Prepare.  Called on the game thread before the writer thread starts.
+    void LoadDescriptors(const CEventDescriptors& descriptors);
+
+    // Forgets what is known about the database; call when the connection is closed.
+    void Reset();
+
+    // Creates or alters the table for pRecord so that it has a column for
+    // every key.  Returns the table's index, or -1 on failure.  Must be called
+    // outside of a transaction.
+    int Prepare(PGconn* db, const CEventRecord* pRecord);
+
+    const EventTable_t& GetTable(int index) const { return *m_Tables[index]; }
+
+    // Returns the index of pRecord's key for column, or -1 if it doesn't have one.
+    static int FindKey(const CEventRecord* pRecord, const EventColumn_t& column);
+
+    // Formats value, whose type differs from type, as text that a column of
+    // type accepts.  Returns false if it has no such form, eg. a string that
+    // isn't a number for an INT4 column.
+    static bool ConvertValue(const EventRecordKey_t& value, KeyValues::types_t type, char* out, int maxLen);
+
+private:
+    EventTable_t* AddTable(const char* pszEvent);
+    int AddColumn(EventTable_t* pTable, const char* pszKey, KeyValues::types_t type);
+    static int FindColumn(const EventTable_t* pTable, const char* pszColumn);
+    bool CheckTable(PGconn* db, EventTable_t* pTable);
+    bool AddMissingColumns(PGconn* db, EventTable_t* pTable);
+    void BuildCopyColumns(EventTable_t* pTable);
+
+    CUtlVector<EventTable_t*> m_Tables;
+    CUtlDict<int, int> m_TableIndex;
+};
+
+#endif // EVENTTABLES_H
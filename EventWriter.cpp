@@ -0,0 +1,1780 @@
+//===========================================================================//
+//
+// Purpose: background thread that owns the stats database connection
+//
+//===========================================================================//
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "EventWriter.h"
+#include "EventRecord.h"
+#include "checksum_crc.h"
+#include "convar.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// #define DB_CONNECT_STR "host=127.0.0.1 port=5432 dbname=tfstats user=tfstats password=fakepassword"
+#if !defined(DB_CONNECT_STR)
+#error "Define DB_CONNECT_STR with PostgreSQL database connection information, eg. \"host=127.0.0.1 dbname=tfstats user=tfstats password=...\""
+#endif
+
+// Reconnect attempts back off exponentially between these delays, in seconds
+#define RECONNECT_MIN_DELAY 5.0
+#define RECONNECT_MAX_DELAY 300.0
+
+// A connection attempt that hasn't completed after this many seconds is abandoned
+#define CONNECT_TIMEOUT 30.0
+
+// Longest the writer waits on the socket per connection poll, so that it still
+// notices Stop() promptly while connecting
+#define CONNECT_POLL_MS 100
+
+// In the priority-preserving queue policy, lifecycle events may use this many
+// slots past eventlogger_queue_size
+#define QUEUE_PRIORITY_RESERVE 1024
+
+// A spooled batch that fails this many times while connected is moved to the
+// dead-letter file, so that it can't hold up the events behind it.  Retries
+// back off exponentially from REPLAY_RETRY_DELAY seconds.
+#define REPLAY_MAX_FAILURES 5
+#define REPLAY_RETRY_DELAY 2.0
+
+// Event ids are reserved from the database this many at a time.  It must match
+// the INCREMENT BY of event_id_seq in tfstats schema.sql.
+#define EVENT_ID_BLOCK_SIZE 1000
+
+// Room for "YYYY-MM-DD HH:MM:SS.uuuuuu" and its terminator
+#define TIMESTAMP_TEXT_SIZE 32
+
+enum WriterStatement_t
+{
+    STMT_INSERT_GAMESESSION,
+    STMT_UPDATE_HEARTBEAT,
+    STMT_RESERVE_EVENT_IDS,
+    STMT_SELECT_EVENTTYPES,
+    STMT_SELECT_EVENTTYPE,
+    STMT_INSERT_EVENTTYPE,
+    STMT_SELECT_EVENTKEYS,
+    STMT_SELECT_EVENTKEY,
+    STMT_INSERT_EVENTKEY,
+    STMT_INSERT_EVENT,
+    STMT_INSERT_EVENT_JSON,
+    STMT_INSERT_EVENTDATA_STRING,
+    STMT_INSERT_EVENTDATA_INT,
+    STMT_INSERT_EVENTDATA_FLOAT,
+    STMT_INSERT_EVENTDATA_BIGINT,
+    STMT_UPSERT_PLAYER,
+    STMT_INSERT_PLAYERNAME,
+
+    STMT_COUNT
+};
+
+enum StorageMode_t
+{
+    STORAGE_EVENTDATA,
+    STORAGE_JSON,
+    STORAGE_WIDE,
+};
+
+enum QueuePolicy_t
+{
+    QUEUE_BLOCK,
+    QUEUE_DROP_NEWEST,
+    QUEUE_DROP_OLDEST,
+    QUEUE_PRIORITY,
+};
+
+static const PreparedStatement_t s_WriterStatements[STMT_COUNT] =
+{
+    { "insert_gamesession", "INSERT INTO GameSession (Heartbeat) VALUES (NOW()) RETURNING Id", 0, { 0 } },
+    { "update_heartbeat", "UPDATE GameSession SET Heartbeat = NOW() WHERE Id = $1", 1, { 23 } },
+    { "reserve_event_ids", "SELECT nextval('event_id_seq')", 0, { 0 } },
+    { "select_eventtypes", "SELECT Id, Name FROM EventType", 0, { 0 } },
+    { "select_eventtype", "SELECT Id FROM EventType WHERE Name = $1", 1, { 25 } },
+    { "insert_eventtype", "INSERT INTO EventType (Name) VALUES ($1) RETURNING Id", 1, { 25 } },
+    { "select_eventkeys", "SELECT Id, Name FROM EventKey", 0, { 0 } },
+    { "select_eventkey", "SELECT Id FROM EventKey WHERE Name = $1", 1, { 25 } },
+    { "insert_eventkey", "INSERT INTO EventKey (Name) VALUES ($1) RETURNING Id", 1, { 25 } },
+    { "insert_event", "INSERT INTO Event (Id, GameSessionId, EventTypeId, DateTime, Tick, CurTimeMs, MonotonicUs, Seq) VALUES ($1, $2, $3, $4, $5, $6, $7, $8) ON CONFLICT DO NOTHING", 8, { 23, 23, 23, 1114, 23, 23, 20, 20 } },
+    { "insert_event_json", "INSERT INTO Event (Id, GameSessionId, EventTypeId, DateTime, Tick, CurTimeMs, MonotonicUs, Seq, Data) VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9) ON CONFLICT DO NOTHING", 9, { 23, 23, 23, 1114, 23, 23, 20, 20, 0 } },
+    { "insert_eventdata_string", "INSERT INTO EventData (EventId, KeyId, DateTime, ValueString) VALUES ($1, $2, $3, $4) ON CONFLICT DO NOTHING", 4, { 23, 23, 1114, 25 } },
+    { "insert_eventdata_int", "INSERT INTO EventData (EventId, KeyId, DateTime, ValueInt) VALUES ($1, $2, $3, $4) ON CONFLICT DO NOTHING", 4, { 23, 23, 1114, 23 } },
+    { "insert_eventdata_float", "INSERT INTO EventData (EventId, KeyId, DateTime, ValueFloat) VALUES ($1, $2, $3, $4) ON CONFLICT DO NOTHING", 4, { 23, 23, 1114, 701 } },
+    { "insert_eventdata_bigint", "INSERT INTO EventData (EventId, KeyId, DateTime, ValueBigInt) VALUES ($1, $2, $3, $4) ON CONFLICT DO NOTHING", 4, { 23, 23, 1114, 20 } },
+    { "upsert_player", "INSERT INTO Player (SteamId, Name) VALUES ($1, $2) ON CONFLICT (SteamId) DO UPDATE SET Name = EXCLUDED.Name, LastSeen = NOW()", 2, { 20, 25 } },
+    { "insert_playername", "INSERT INTO PlayerName (SteamId, Name) VALUES ($1, $2) ON CONFLICT DO NOTHING", 2, { 20, 25 } },
+};
+
+static ConVar eventlogger_queue_size("eventlogger_queue_size", "50000", 0, "Most events that can wait for the stats database writer before eventlogger_queue_policy applies", true, 1.0f, false, 0.0f);
+static ConVar eventlogger_queue_policy("eventlogger_queue_policy", "3", 0, "What to do with an event when the queue is full: 0 blocks the game for up to eventlogger_queue_block_timeout, 1 drops it, 2 drops the oldest queued event, 3 drops it unless it is a plugin lifecycle event", true, 0.0f, true, 3.0f);
+static ConVar eventlogger_queue_block_timeout("eventlogger_queue_block_timeout", "50", 0, "Milliseconds the game waits for room in a full queue under eventlogger_queue_policy 0 before dropping the event", true, 0.0f, true, 1000.0f);
+static void StorageChanged(IConVar* var, const char* pOldValue, float flOldValue);
+static ConVar eventlogger_storage("eventlogger_storage", "eventdata", 0, "How events are stored: \"eventdata\" writes an Event row and an EventData row per key, \"json\" one Event row with its keys in Event.Data, \"wide\" one row of a typed ev_<event name> table", StorageChanged);
+static ConVar eventlogger_copy("eventlogger_copy", "1", 0, "Write queued events to the stats database in bulk with COPY; 0 uses one INSERT per row");
+static ConVar eventlogger_batch_size("eventlogger_batch_size", "500", 0, "Number of events the stats database writer commits in one transaction", true, 1.0f, true, 10000.0f);
+static ConVar eventlogger_batch_linger("eventlogger_batch_linger", "250", 0, "Milliseconds the stats database writer waits for a batch to fill before committing it anyway", true, 0.0f, true, 10000.0f);
+static ConVar eventlogger_spool("eventlogger_spool", "1", 0, "Spool events to disk while the stats database is unreachable or falling behind, and replay them later");
+static ConVar eventlogger_spool_backlog("eventlogger_spool_backlog", "10000", 0, "Queued events above which the stats database writer spools batches to disk instead of writing them", true, 0.0f, false, 0.0f);
+
+// StorageMode_t of eventlogger_storage.  The game thread frees the ConVar's
+// string when it changes, so only the game thread reads it, and the writer
+// reads this instead.
+static volatile int s_nStorageMode = STORAGE_EVENTDATA;
+
+static int ParseStorageMode(const char* storage)
+{
+    if (Q_stricmp(storage, "wide") == 0)
+        return STORAGE_WIDE;
+    if (Q_stricmp(storage, "json") == 0)
+        return STORAGE_JSON;
+    return STORAGE_EVENTDATA;
+}
+
+static void StorageChanged(IConVar* var, const char* pOldValue, float flOldValue)
+{
+    s_nStorageMode = ParseStorageMode(eventlogger_storage.GetString());
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: constructor/destructor
+//---------------------------------------------------------------------------------
+CEventWriter::CEventWriter()
+    : m_Statements(s_WriterStatements, STMT_COUNT),
+      m_PlayerNames(DefLessFunc(uint64)),
+      m_EventTypeIds(k_eDictCompareTypeCaseSensitive),
+      m_EventKeyIds(k_eDictCompareTypeCaseSensitive)
+{
+    m_hThread = NULL;
+    m_bStopping = false;
+    m_bHeartbeatRequested = false;
+    m_bWaitingForSpace = false;
+    m_nQueuePeak = 0;
+    m_bOverflowing = false;
+    m_flDrainDeadline = 0.0;
+    m_flBatchStart = 0.0;
+    m_pCancel = NULL;
+    m_ConnectState = DB_DISCONNECTED;
+    m_PollStatus = PGRES_POLLING_FAILED;
+    m_flConnectStart = 0.0;
+    m_flNextConnect = 0.0;
+    m_flReconnectDelay = RECONNECT_MIN_DELAY;
+    m_db = NULL;
+    SetGameSessionId(0);
+    m_nTimestampSecond = -1;
+    m_ulNextSeq = 0;
+    m_bBatchResend = false;
+    m_nextEventId = 0;
+    m_eventIdsLeft = 0;
+    m_BatchStorage = STORAGE_EVENTDATA;
+    m_szSpoolDirectory[0] = '\0';
+    m_bSpoolReady = false;
+    m_nReplayFailures = 0;
+    m_flNextReplay = 0.0;
+    for (int i = 0; i < KEY_SYMBOL_CACHE_SIZE; i++)
+        m_KeySymbolCache[i].m_Symbol = INVALID_KEY_SYMBOL;
+}
+
+CEventWriter::~CEventWriter()
+{
+    PlayerRecord_t* pPlayer;
+    while (m_FreePlayers.PopItem(&pPlayer))
+        delete pPlayer;
+}
+
+void CEventWriter::LoadEventDescriptors(const CEventDescriptors& descriptors)
+{
+    Assert(m_hThread == NULL);
+    m_Tables.LoadDescriptors(descriptors);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: called on the game thread from Load
+//---------------------------------------------------------------------------------
+bool CEventWriter::Start(const char* pszSpoolDirectory)
+{
+    Q_strncpy(m_szSpoolDirectory, pszSpoolDirectory, sizeof(m_szSpoolDirectory));
+    m_bStopping = false;
+    m_bHeartbeatRequested = false;
+    m_bNewGameSession = 0;
+    m_flNextConnect = 0.0;
+    m_flReconnectDelay = RECONNECT_MIN_DELAY;
+    s_nStorageMode = ParseStorageMode(eventlogger_storage.GetString());
+    m_Partitions.ReadSettings();
+
+    m_hThread = CreateSimpleThread(ThreadProc, this);
+    if (m_hThread == NULL)
+    {
+        Warning("Failed to start stats database writer thread\n");
+        return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: called on the game thread from Unload, after the last event is queued
+//---------------------------------------------------------------------------------
+void CEventWriter::Stop(float flDrainTimeout)
+{
+    if (m_hThread == NULL)
+        return;
+
+    m_flDrainDeadline = Plat_FloatTime() + flDrainTimeout;
+    m_bStopping = true;
+    m_WakeEvent.Set();
+
+    if (!ThreadJoin(m_hThread, (unsigned)(flDrainTimeout * 1000.0f)))
+    {
+        // The writer is stuck in a query; cancel it so the thread notices the deadline.
+        m_CancelMutex.Lock();
+        if (m_pCancel != NULL)
+        {
+            char errbuf[256];
+            if (!PQcancel(m_pCancel, errbuf, sizeof(errbuf)))
+                Warning("Failed to cancel stats database query: %s\n", errbuf);
+        }
+        m_CancelMutex.Unlock();
+
+        ThreadJoin(m_hThread);
+    }
+
+    ReleaseThreadHandle(m_hThread);
+    m_hThread = NULL;
+
+    // The thread has exited, so nothing else can be popping from the queue now.
+    CEventRecord* pRecord;
+    while (m_Queue.PopItem(&pRecord))
+        delete pRecord;
+    PlayerRecord_t* pPlayer;
+    while (m_PlayerQueue.PopItem(&pPlayer))
+        delete pPlayer;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: called on the game thread
+//---------------------------------------------------------------------------------
+void CEventWriter::QueueEvent(const CEventRecordBuilder& event)
+{
+    if (m_hThread == NULL)
+        return;
+
+#ifdef _DEBUG
+    int heapAllocs = g_nCaptureHeapAllocs;
+    int arenas = m_Arenas.GetArenaCount();
+#endif
+
+    CEventRecord* pRecord = CaptureEvent(event, &m_Arenas);
+
+#ifdef _DEBUG
+    // Adding an arena is the only heap allocation capturing an event may make,
+    // and that stops once there are enough for the queue
+    AssertMsg(g_nCaptureHeapAllocs - heapAllocs == m_Arenas.GetArenaCount() - arenas, "Capturing an event allocated from the heap");
+#endif
+
+    QueueRecord(pRecord);
+}
+
+CEventRecord* CEventWriter::CaptureEvent(const CEventRecordBuilder& event, CEventArenas* pArenas)
+{
+    CEventRecord* pRecord = event.Finish(pArenas);
+
+    // Seq starts from the first event's wall clock time, so that it keeps
+    // increasing across restarts and events replayed from the spool into a
+    // later GameSession sort before, and never collide with, that session's own
+    if (m_ulNextSeq == 0)
+        m_ulNextSeq = pRecord->GetTime().m_ulWallClock;
+    pRecord->SetSeq(m_ulNextSeq++);
+    return pRecord;
+}
+
+void CEventWriter::QueueRecord(CEventRecord* pRecord)
+{
+    if (m_hThread == NULL)
+    {
+        delete pRecord;
+        return;
+    }
+
+    int queued = m_Queue.Count();
+    if (queued >= eventlogger_queue_size.GetInt() && !MakeRoom(pRecord))
+    {
+        DropEvent(pRecord);
+        return;
+    }
+    if (m_bOverflowing && queued < eventlogger_queue_size.GetInt() / 2)
+        m_bOverflowing = false;
+
+    m_Queue.PushItem(pRecord);
+    if (queued + 1 > m_nQueuePeak)
+        m_nQueuePeak = queued + 1;
+    m_WakeEvent.Set();
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: applies eventlogger_queue_policy to a full queue.  Returns true if
+//          pRecord should be queued anyway.
+//---------------------------------------------------------------------------------
+bool CEventWriter::MakeRoom(const CEventRecord* pRecord)
+{
+    int capacity = eventlogger_queue_size.GetInt();
+    switch (eventlogger_queue_policy.GetInt())
+    {
+    case QUEUE_BLOCK:
+        {
+            // Once a wait has timed out, don't stall every following frame as well
+            if (m_bOverflowing)
+                return false;
+
+            double deadline = Plat_FloatTime() + eventlogger_queue_block_timeout.GetFloat() / 1000.0f;
+            m_bWaitingForSpace = true;
+            m_WakeEvent.Set();
+            while (m_Queue.Count() >= capacity)
+            {
+                double remaining = deadline - Plat_FloatTime();
+                if (remaining <= 0.0)
+                    break;
+                m_SpaceEvent.Wait((unsigned)(remaining * 1000.0) + 1);
+            }
+            m_bWaitingForSpace = false;
+            return m_Queue.Count() < capacity;
+        }
+
+    case QUEUE_DROP_OLDEST:
+        {
+            CEventRecord* pOldest;
+            while (m_Queue.Count() >= capacity && m_Queue.PopItem(&pOldest))
+                DropEvent(pOldest);
+            return true;
+        }
+
+    case QUEUE_PRIORITY:
+        // The plugin's own events (_client_connect, _level_init, ...) are rare and
+        // say who was playing what; game events like player_hurt can be shed.
+        return pRecord->GetName()[0] == '_' && m_Queue.Count() < capacity + QUEUE_PRIORITY_RESERVE;
+
+    case QUEUE_DROP_NEWEST:
+    default:
+        return false;
+    }
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: discards an event that didn't fit in the queue, counting it by name
+//---------------------------------------------------------------------------------
+void CEventWriter::DropEvent(CEventRecord* pRecord)
+{
+    if (!m_bOverflowing)
+    {
+        Warning("Event queue is full (%d events); dropping events until the stats database writer catches up\n", m_Queue.Count());
+        m_bOverflowing = true;
+    }
+
+    int index = m_Dropped.Find(pRecord->GetName());
+    if (index == m_Dropped.InvalidIndex())
+        index = m_Dropped.Insert(pRecord->GetName(), 0);
+    m_Dropped[index]++;
+
+    delete pRecord;
+}
+
+void CEventWriter::QueuePlayer(uint64 steamId, const char* pszName)
+{
+    if (m_hThread == NULL)
+        return;
+
+    PlayerRecord_t* pPlayer;
+    if (!m_FreePlayers.PopItem(&pPlayer))
+    {
+        CAPTURE_HEAP_ALLOC();
+        pPlayer = new PlayerRecord_t;
+    }
+    pPlayer->m_steamId = steamId;
+    Q_strncpy(pPlayer->m_szName, pszName, sizeof(pPlayer->m_szName));
+    pPlayer->m_nNameLength = strlen(pPlayer->m_szName);
+    m_PlayerQueue.PushItem(pPlayer);
+    m_WakeEvent.Set();
+}
+
+void CEventWriter::RequestHeartbeat()
+{
+    m_bHeartbeatRequested = true;
+    m_WakeEvent.Set();
+}
+
+void CEventWriter::PrintStats()
+{
+    Msg("Event queue: %d queued, %d peak, capacity %d, %d record arenas\n", m_Queue.Count(), m_nQueuePeak, eventlogger_queue_size.GetInt(), m_Arenas.GetArenaCount());
+    if (m_Dropped.Count() != 0)
+    {
+        Msg("%-32s %10s\n", "dropped event", "count");
+        for (int i = m_Dropped.First(); i != m_Dropped.InvalidIndex(); i = m_Dropped.Next(i))
+            Msg("%-32s %10d\n", m_Dropped.GetElementName(i), m_Dropped[i]);
+    }
+
+    m_Statements.PrintStats();
+}
+
+bool CEventWriter::CheckNewGameSession()
+{
+    return m_bNewGameSession.AssignIf(1, 0);
+}
+
+unsigned CEventWriter::ThreadProc(void* pParam)
+{
+    ThreadSetDebugName("EventLoggerWriter");
+    return ((CEventWriter*)pParam)->Run();
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writer thread main loop
+//---------------------------------------------------------------------------------
+unsigned CEventWriter::Run()
+{
+    m_bSpoolReady = eventlogger_spool.GetBool() && m_Spool.Init(m_szSpoolDirectory);
+
+    int discarded = 0;
+    for (;;)
+    {
+        m_WakeEvent.Wait(GetWakeTimeout());
+
+        UpdateConnection();
+
+        // Hold queued events while a connection attempt is in progress, unless
+        // we are unloading and have run out of time to wait for it.
+        if (m_ConnectState == DB_CONNECTING && !(m_bStopping && Plat_FloatTime() > m_flDrainDeadline))
+            continue;
+
+        if (m_ConnectState == DB_CONNECTED && !m_bStopping && m_Partitions.IsDue())
+            m_Partitions.Maintain(m_db);
+
+        if (m_ConnectState == DB_CONNECTED)
+            UpdatePlayers();
+
+        if (m_bHeartbeatRequested)
+        {
+            m_bHeartbeatRequested = false;
+            Heartbeat();
+        }
+
+        if (!m_bStopping)
+            ReplaySpool();
+
+        DrainQueue(discarded);
+
+        if (m_bStopping)
+            break;
+    }
+
+    if (discarded != 0)
+        Warning("Discarded %d events that could not be written before unload\n", discarded);
+
+    DatabaseDisconnect();
+    m_Spool.Shutdown();
+    m_bSpoolReady = false;
+    return 0;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: how long the writer thread can sleep before it has work to do, in ms
+//---------------------------------------------------------------------------------
+unsigned CEventWriter::GetWakeTimeout()
+{
+    // PollConnect does its own waiting on the socket
+    if (m_ConnectState == DB_CONNECTING)
+        return 0;
+
+    // Keep replaying the spool for as long as there is a connection to replay
+    // it to, unless a failed replay is backing off
+    bool bReplay = (m_ConnectState == DB_CONNECTED && m_bSpoolReady && m_Spool.HasData() && !m_bStopping);
+    if (bReplay && Plat_FloatTime() >= m_flNextReplay)
+        return 0;
+
+    double wake = -1.0;
+    if (m_ConnectState == DB_DISCONNECTED && !m_bStopping)
+        wake = m_flNextConnect;
+    else if (m_ConnectState == DB_CONNECTED && !m_bStopping)
+        wake = m_Partitions.GetNextRun();
+
+    if (bReplay && (wake < 0.0 || m_flNextReplay < wake))
+        wake = m_flNextReplay;
+
+    // A partly filled batch is held until it lingers too long
+    if (m_Batch.Count() != 0)
+    {
+        double batchDue = m_flBatchStart + eventlogger_batch_linger.GetFloat() / 1000.0f;
+        if (wake < 0.0 || batchDue < wake)
+            wake = batchDue;
+    }
+
+    if (wake < 0.0)
+        return TT_INFINITE;
+
+    double remaining = wake - Plat_FloatTime();
+    return remaining > 0.0 ? (unsigned)(remaining * 1000.0) + 1 : 0;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: advances the connection state machine one step.  Connections are made
+//          with PQconnectStart/PQconnectPoll, so a dead stats host never blocks
+//          the writer for longer than CONNECT_POLL_MS at a time.
+//---------------------------------------------------------------------------------
+void CEventWriter::UpdateConnection()
+{
+    switch (m_ConnectState)
+    {
+    case DB_CONNECTED:
+        if (PQstatus(m_db) != CONNECTION_OK)
+        {
+            Warning("Lost connection to stats database: %s\n", PQerrorMessage(m_db));
+            DatabaseDisconnect();
+            m_flNextConnect = Plat_FloatTime();
+        }
+        break;
+
+    case DB_DISCONNECTED:
+        if (!m_bStopping && Plat_FloatTime() >= m_flNextConnect)
+            StartConnect();
+        break;
+
+    case DB_CONNECTING:
+        PollConnect();
+        break;
+    }
+}
+
+void CEventWriter::StartConnect()
+{
+    Msg("Connecting to stats database...\n");
+    m_db = PQconnectStart(DB_CONNECT_STR);
+    if (m_db == NULL || PQstatus(m_db) == CONNECTION_BAD)
+    {
+        ConnectFailed();
+        return;
+    }
+
+    m_ConnectState = DB_CONNECTING;
+    m_flConnectStart = Plat_FloatTime();
+    m_PollStatus = PGRES_POLLING_WRITING;
+}
+
+void CEventWriter::PollConnect()
+{
+    if (Plat_FloatTime() - m_flConnectStart > CONNECT_TIMEOUT)
+    {
+        Warning("Timed out connecting to stats database\n");
+        ConnectFailed();
+        return;
+    }
+
+    // PQconnectPoll may only be called once the socket is ready for whatever it
+    // asked for last time.
+    int sock = PQsocket(m_db);
+    if (sock < 0)
+    {
+        ConnectFailed();
+        return;
+    }
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = CONNECT_POLL_MS * 1000;
+    int ready;
+    if (m_PollStatus == PGRES_POLLING_READING)
+        ready = select(sock + 1, &fds, NULL, NULL, &tv);
+    else
+        ready = select(sock + 1, NULL, &fds, NULL, &tv);
+    if (ready == 0)
+        return;
+
+    m_PollStatus = PQconnectPoll(m_db);
+    if (m_PollStatus == PGRES_POLLING_OK)
+        FinishConnect();
+    else if (m_PollStatus == PGRES_POLLING_FAILED)
+        ConnectFailed();
+}
+
+void CEventWriter::ConnectFailed()
+{
+    Warning("Failed to connect to stats database: %s\n", m_db != NULL ? PQerrorMessage(m_db) : "out of memory");
+    DatabaseDisconnect();
+
+    m_flNextConnect = Plat_FloatTime() + m_flReconnectDelay;
+    m_flReconnectDelay *= 2.0;
+    if (m_flReconnectDelay > RECONNECT_MAX_DELAY)
+        m_flReconnectDelay = RECONNECT_MAX_DELAY;
+}
+
+void CEventWriter::FinishConnect()
+{
+    Msg("Successfully connected to stats database.\n");
+
+    // Events are timestamped in UTC.  Running the session in UTC keeps NOW()
+    // and the partition boundaries in agreement with them.
+    if (!ExecCommand("SET TimeZone = 'UTC'"))
+    {
+        ConnectFailed();
+        return;
+    }
+
+    PGresult* res = m_Statements.Exec(m_db, STMT_INSERT_GAMESESSION, NULL, NULL, NULL);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        Warning("\"INSERT INTO GameSession\" failed\n");
+        PQclear(res);
+        ConnectFailed();
+        return;
+    }
+
+    SetGameSessionId(atoi(PQgetvalue(res, 0, 0)));
+    PQclear(res);
+
+    LoadNameIds(m_EventTypeIds, STMT_SELECT_EVENTTYPES);
+    LoadNameIds(m_EventKeyIds, STMT_SELECT_EVENTKEYS);
+
+    m_CancelMutex.Lock();
+    m_pCancel = PQgetCancel(m_db);
+    m_CancelMutex.Unlock();
+
+    m_ConnectState = DB_CONNECTED;
+    m_flReconnectDelay = RECONNECT_MIN_DELAY;
+    m_Partitions.Reset();
+    m_PlayerNames.RemoveAll();
+
+    // The game thread logs _new_gamesession and _existing_client when it sees this
+    m_bNewGameSession = 1;
+}
+
+void CEventWriter::DatabaseDisconnect()
+{
+    m_CancelMutex.Lock();
+    if (m_pCancel != NULL)
+    {
+        PQfreeCancel(m_pCancel);
+        m_pCancel = NULL;
+    }
+    m_CancelMutex.Unlock();
+
+    if (m_db != NULL)
+    {
+        PQfinish(m_db);
+        m_db = NULL;
+    }
+    m_Statements.Reset();
+    m_Tables.Reset();
+    SetGameSessionId(0);
+    m_ConnectState = DB_DISCONNECTED;
+}
+
+void CEventWriter::Heartbeat()
+{
+    if (m_ConnectState != DB_CONNECTED || PQstatus(m_db) != CONNECTION_OK)
+        return;
+
+    const char* const values[] = { m_GameSessionIdBinary };
+    const int lengths[] = { sizeof(m_GameSessionIdBinary) };
+    const int paramFormats[] = { 1, };
+    PGresult* res = m_Statements.Exec(m_db, STMT_UPDATE_HEARTBEAT, values, lengths, paramFormats);
+    ExecStatusType resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COMMAND_OK)
+        Warning("\"UPDATE GameSession SET Heartbeat\" failed\n");
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: encodes the session id once, rather than for every row written
+//---------------------------------------------------------------------------------
+void CEventWriter::SetGameSessionId(int id)
+{
+    m_gameSessionId = id;
+    m_nGameSessionIdLength = Q_snprintf(m_szGameSessionId, sizeof(m_szGameSessionId), "%d", id);
+    EncodeInt4(m_GameSessionIdBinary, id);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: formats an EventTime_t wall clock time as COPY text for a TIMESTAMP
+//          column, in UTC like the session.  out must have room for
+//          TIMESTAMP_TEXT_SIZE characters.  Returns the length.
+//---------------------------------------------------------------------------------
+int CEventWriter::FormatTimestamp(char* out, uint64 wallClock)
+{
+    // Events arrive in order, so most share the second formatted last time
+    int64 second = (int64)(wallClock / 1000000);
+    if (second != m_nTimestampSecond)
+    {
+        time_t t = (time_t)second;
+        struct tm utc;
+#ifdef _WIN32
+        gmtime_s(&utc, &t);
+#else
+        gmtime_r(&t, &utc);
+#endif
+        strftime(m_szTimestampSecond, sizeof(m_szTimestampSecond), "%Y-%m-%d %H:%M:%S", &utc);
+        m_nTimestampSecond = second;
+    }
+    return Q_snprintf(out, TIMESTAMP_TEXT_SIZE, "%s.%06d", m_szTimestampSecond, (int)(wallClock % 1000000));
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes queued players to the Player table, skipping any whose name
+//          hasn't changed since they were last written this GameSession.
+//          Players stay queued while there is no connection.
+//---------------------------------------------------------------------------------
+void CEventWriter::UpdatePlayers()
+{
+    PlayerRecord_t* pPlayer;
+    while (m_PlayerQueue.PopItem(&pPlayer))
+    {
+        uint32 nameCrc = (uint32)CRC32_ProcessSingleBuffer(pPlayer->m_szName, pPlayer->m_nNameLength);
+        int index = m_PlayerNames.Find(pPlayer->m_steamId);
+        if (index != m_PlayerNames.InvalidIndex() && m_PlayerNames[index] == nameCrc)
+        {
+            m_FreePlayers.PushItem(pPlayer);
+            continue;
+        }
+
+        if (UpsertPlayer(pPlayer->m_steamId, pPlayer->m_szName, pPlayer->m_nNameLength))
+        {
+            if (index == m_PlayerNames.InvalidIndex())
+                m_PlayerNames.Insert(pPlayer->m_steamId, nameCrc);
+            else
+                m_PlayerNames[index] = nameCrc;
+        }
+        else if (PQstatus(m_db) != CONNECTION_OK)
+        {
+            // Try again once reconnected
+            m_PlayerQueue.PushItem(pPlayer);
+            return;
+        }
+        m_FreePlayers.PushItem(pPlayer);
+    }
+}
+
+bool CEventWriter::UpsertPlayer(uint64 steamId, const char* pszName, int nameLength)
+{
+    char steamIdValue[8];
+    EncodeInt8(steamIdValue, steamId);
+
+    const char* const values[] = { steamIdValue, pszName };
+    const int lengths[] = { sizeof(steamIdValue), nameLength };
+    const int paramFormats[] = { 1, 0 };
+
+    PGresult* res = m_Statements.Exec(m_db, STMT_UPSERT_PLAYER, values, lengths, paramFormats);
+    ExecStatusType resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COMMAND_OK)
+    {
+        Warning("\"INSERT INTO Player\" failed: %s", PQerrorMessage(m_db));
+        return false;
+    }
+
+    res = m_Statements.Exec(m_db, STMT_INSERT_PLAYERNAME, values, lengths, paramFormats);
+    resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COMMAND_OK)
+    {
+        Warning("\"INSERT INTO PlayerName\" failed: %s", PQerrorMessage(m_db));
+        return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: moves queued events into the current batch, committing it whenever it
+//          reaches eventlogger_batch_size events or its first event has waited
+//          eventlogger_batch_linger milliseconds
+//---------------------------------------------------------------------------------
+void CEventWriter::DrainQueue(int& discarded)
+{
+    CEventRecord* pRecord;
+    while (m_Queue.PopItem(&pRecord))
+    {
+        if (m_bWaitingForSpace)
+            m_SpaceEvent.Set();
+
+        if (m_bStopping && Plat_FloatTime() > m_flDrainDeadline && !m_bSpoolReady)
+        {
+            discarded++;
+            delete pRecord;
+            continue;
+        }
+
+        if (m_Batch.Count() == 0)
+            m_flBatchStart = Plat_FloatTime();
+
+        m_Batch.AddToTail(pRecord);
+        if (m_Batch.Count() >= eventlogger_batch_size.GetInt())
+            FlushBatch();
+    }
+
+    if (m_Batch.Count() != 0 &&
+        (m_bStopping || Plat_FloatTime() >= m_flBatchStart + eventlogger_batch_linger.GetFloat() / 1000.0f))
+    {
+        FlushBatch();
+    }
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes the current batch to the database, or to the spool when the
+//          database is unreachable, the writer is falling behind, or older
+//          events are still waiting in the spool (so events stay in order)
+//---------------------------------------------------------------------------------
+void CEventWriter::FlushBatch()
+{
+    if (m_Batch.Count() == 0)
+        return;
+
+    bool bConnected = (m_ConnectState == DB_CONNECTED && PQstatus(m_db) == CONNECTION_OK);
+    bool bSpool = m_bSpoolReady &&
+        (!bConnected || m_Spool.HasData() || m_Queue.Count() > eventlogger_spool_backlog.GetInt() ||
+         (m_bStopping && Plat_FloatTime() > m_flDrainDeadline));
+
+    if (bSpool)
+    {
+        SpoolEvents(0);
+    }
+    else if (bConnected)
+    {
+        if (PrepareBatch())
+        {
+            int unwritten = WriteEvents(0, m_Batch.Count());
+            if (unwritten < m_Batch.Count())
+                SpoolEvents(unwritten);
+        }
+        else if (PQstatus(m_db) != CONNECTION_OK)
+        {
+            SpoolEvents(0);
+        }
+        else
+        {
+            Warning("Dropped %d events that could not be prepared for writing\n", m_Batch.Count());
+        }
+    }
+
+    m_Batch.PurgeAndDeleteElements();
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: appends m_Batch[first ..] to the spool
+//---------------------------------------------------------------------------------
+void CEventWriter::SpoolEvents(int first)
+{
+    int count = m_Batch.Count() - first;
+    if (!m_bSpoolReady)
+    {
+        Warning("Dropped %d events after losing the stats database connection\n", count);
+        return;
+    }
+
+    if (!m_Spool.Append(m_Batch.Base() + first, count))
+        Warning("Dropped %d events that could not be spooled\n", count);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes one batch of spooled events to the database.  The spool only
+//          forgets them once they are committed, so a failure here replays the
+//          same events next time, with the same ids.
+//---------------------------------------------------------------------------------
+void CEventWriter::ReplaySpool()
+{
+    if (!m_bSpoolReady || !m_Spool.HasData() || m_ConnectState != DB_CONNECTED || Plat_FloatTime() < m_flNextReplay)
+        return;
+
+    // A partial batch from the queue is newer than anything in the spool
+    FlushBatch();
+
+    if (m_Spool.Read(m_Batch, eventlogger_batch_size.GetInt()) == 0)
+        return;
+
+    bool bUnassigned = false;
+    for (int i = 0; i < m_Batch.Count() && !bUnassigned; i++)
+        bUnassigned = (m_Batch[i]->GetEventId() == 0);
+
+    // Ids given out here must survive a lost COMMIT reply or a crash, or the
+    // retry would write the same events again under new ids
+    bool bWritten = false;
+    if (PrepareBatch() && (!bUnassigned || m_Spool.SaveIds(m_Batch.Base(), m_Batch.Count())))
+        bWritten = (WriteEvents(0, m_Batch.Count()) == m_Batch.Count());
+
+    if (bWritten)
+    {
+        m_Spool.Commit();
+        m_nReplayFailures = 0;
+        m_flNextReplay = 0.0;
+    }
+    else if (PQstatus(m_db) == CONNECTION_OK)
+    {
+        // Losing the connection is retried on reconnect as usual; a batch that
+        // fails with the connection up backs off, and is set aside for good if
+        // it keeps failing, rather than holding up every newer event behind it
+        if (++m_nReplayFailures < REPLAY_MAX_FAILURES)
+        {
+            m_flNextReplay = Plat_FloatTime() + REPLAY_RETRY_DELAY * (1 << (m_nReplayFailures - 1));
+        }
+        else
+        {
+            if (m_Spool.DeadLetter(m_Batch.Base(), m_Batch.Count()))
+                Warning("Moved %d spooled events that failed to be written %d times to the dead-letter file\n", m_Batch.Count(), m_nReplayFailures);
+            else
+                Warning("Unable to set aside %d spooled events that failed to be written %d times; retrying them\n", m_Batch.Count(), m_nReplayFailures);
+            m_nReplayFailures = 0;
+            m_flNextReplay = 0.0;
+        }
+    }
+
+    m_Batch.PurgeAndDeleteElements();
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes m_Batch[first .. first + count) in one transaction.  If that
+//          fails, each half is retried in its own transaction, so that a single
+//          bad event only loses itself rather than the whole batch.  Returns
+//          the index of the first event left unwritten because the connection
+//          was lost, or first + count.
+//---------------------------------------------------------------------------------
+int CEventWriter::WriteEvents(int first, int count)
+{
+    bool success;
+    if (m_BatchStorage == STORAGE_WIDE)
+        success = CopyWideEvents(first, count);
+    else if (eventlogger_copy.GetBool())
+        success = CopyEvents(first, count);
+    else
+        success = InsertEvents(first, count);
+    if (success)
+        return first + count;
+
+    if (PQstatus(m_db) != CONNECTION_OK)
+        return first;
+
+    if (count == 1)
+    {
+        Warning("Dropped event %s that could not be written\n", m_Batch[first]->GetName());
+        return first + count;
+    }
+
+    int half = count / 2;
+    int unwritten = WriteEvents(first, half);
+    if (unwritten < first + half)
+        return unwritten;
+    return WriteEvents(first + half, count - half);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: runs a statement that returns no rows, such as BEGIN or COMMIT
+//---------------------------------------------------------------------------------
+bool CEventWriter::ExecCommand(const char* sql)
+{
+    PGresult* res = PQexec(m_db, sql);
+    ExecStatusType resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COMMAND_OK)
+    {
+        Warning("\"%s\" failed: %s", sql, PQerrorMessage(m_db));
+        return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: does everything a batch needs from the database before its
+//          transaction starts
+//---------------------------------------------------------------------------------
+bool CEventWriter::PrepareBatch()
+{
+    if (!AssignEventIds())
+        return false;
+    // Read once per batch so that changing the ConVar can't split one
+    m_BatchStorage = s_nStorageMode;
+
+    if (m_BatchStorage == STORAGE_WIDE)
+        return PrepareWideTables() && ResolveNameIds(true);
+    return ResolveNameIds(m_BatchStorage == STORAGE_EVENTDATA);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: gives every event in the batch an Event.Id, so that Event and EventData
+//          rows can be sent together without waiting for INSERT ... RETURNING.
+//          Each nextval() on event_id_seq reserves a block of EVENT_ID_BLOCK_SIZE
+//          ids; unused ids in a block are never handed out again, so a block
+//          survives reconnects.
+//
+//          Events keep the id and GameSession they are first given.  If any
+//          already had them, the batch is being written again and some of it
+//          may already be in the database; see Copy.
+//---------------------------------------------------------------------------------
+bool CEventWriter::AssignEventIds()
+{
+    m_bBatchResend = false;
+    m_BatchIds.SetCount(m_Batch.Count());
+    for (int i = 0; i < m_Batch.Count(); i++)
+    {
+        CEventRecord* pRecord = m_Batch[i];
+        if (pRecord->GetEventId() != 0)
+        {
+            m_BatchIds[i] = pRecord->GetEventId();
+            m_bBatchResend = true;
+            continue;
+        }
+
+        if (m_eventIdsLeft == 0)
+        {
+            PGresult* res = m_Statements.Exec(m_db, STMT_RESERVE_EVENT_IDS, NULL, NULL, NULL);
+            if (PQresultStatus(res) != PGRES_TUPLES_OK)
+            {
+                Warning("Reserving event ids failed: %s", PQerrorMessage(m_db));
+                PQclear(res);
+                return false;
+            }
+            m_nextEventId = atoi(PQgetvalue(res, 0, 0));
+            m_eventIdsLeft = EVENT_ID_BLOCK_SIZE;
+            PQclear(res);
+        }
+
+        m_BatchIds[i] = m_nextEventId++;
+        m_eventIdsLeft--;
+        pRecord->SetEventId(m_BatchIds[i]);
+        pRecord->SetGameSessionId(m_gameSessionId);
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: makes sure every event in the batch has a table with a column for
+//          each of its keys.  DDL can't go in the batch's transaction, or one
+//          failed ALTER TABLE would abort it.  Events whose table can't be
+//          prepared are written to Event and EventData instead.
+//---------------------------------------------------------------------------------
+bool CEventWriter::PrepareWideTables()
+{
+    m_BatchTables.SetCount(m_Batch.Count());
+    for (int i = 0; i < m_Batch.Count(); i++)
+    {
+        m_BatchTables[i] = m_Tables.Prepare(m_db, m_Batch[i]);
+        if (m_BatchTables[i] >= 0)
+            continue;
+        if (PQstatus(m_db) != CONNECTION_OK)
+            return false;
+
+        // Prepare has said why; say what becomes of the events once a batch
+        bool bWarned = false;
+        for (int j = 0; j < i && !bWarned; j++)
+            bWarned = (m_BatchTables[j] < 0 && Q_strcmp(m_Batch[j]->GetName(), m_Batch[i]->GetName()) == 0);
+        if (!bWarned)
+            Warning("Writing %s events to EventData, as their table could not be prepared\n", m_Batch[i]->GetName());
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: whether a batch event goes to Event and EventData, as every event
+//          does except those in wide storage with a table prepared for them
+//---------------------------------------------------------------------------------
+bool CEventWriter::IsNarrowEvent(int i) const
+{
+    return m_BatchStorage != STORAGE_WIDE || m_BatchTables[i] < 0;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: fills in the EventType ids, and EventKey ids if bKeys is set, of every
+//          event in the batch.  Names are looked up outside the batch's
+//          transaction, so a failed lookup doesn't abort it, and are cached for
+//          the life of the plugin.
+//---------------------------------------------------------------------------------
+bool CEventWriter::ResolveNameIds(bool bKeys)
+{
+    for (int i = 0; i < m_Batch.Count(); i++)
+    {
+        CEventRecord* pRecord = m_Batch[i];
+        if (!IsNarrowEvent(i))
+            continue;
+
+        int typeId = LookupNameId(m_EventTypeIds, STMT_SELECT_EVENTTYPE, STMT_INSERT_EVENTTYPE, pRecord->GetName());
+        if (typeId == 0)
+            return false;
+        pRecord->SetTypeId(typeId);
+
+        for (int j = 0; bKeys && j < pRecord->GetKeyCount(); j++)
+        {
+            int keyId = LookupKeyId(pRecord, j);
+            if (keyId == 0)
+                return false;
+            pRecord->SetKeyId(j, keyId);
+        }
+    }
+    return true;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: returns the EventKey id of a record's key, going by its KeyValues
+//          symbol when it has one
+//---------------------------------------------------------------------------------
+int CEventWriter::LookupKeyId(const CEventRecord* pRecord, int key)
+{
+    HKeySymbol symbol = pRecord->GetKey(key).m_Symbol;
+    if (symbol == INVALID_KEY_SYMBOL)
+        return LookupNameId(m_EventKeyIds, STMT_SELECT_EVENTKEY, STMT_INSERT_EVENTKEY, pRecord->GetKeyName(key));
+
+    // Symbols are offsets into the KeyValues string pool, so their low bits
+    // are poorly distributed; mix them before picking a slot.
+    KeySymbolSlot_t& slot = m_KeySymbolCache[((unsigned)symbol * 2654435761u >> 16) & (KEY_SYMBOL_CACHE_SIZE - 1)];
+    if (slot.m_Symbol == symbol)
+        return slot.m_iKeyId;
+
+    int keyId = LookupNameId(m_EventKeyIds, STMT_SELECT_EVENTKEY, STMT_INSERT_EVENTKEY, pRecord->GetKeyName(key));
+    if (keyId != 0)
+    {
+        slot.m_Symbol = symbol;
+        slot.m_iKeyId = keyId;
+    }
+    return keyId;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: returns the dictionary id of name, adding it to the table if this is
+//          the first time it has been seen, or 0 on failure
+//---------------------------------------------------------------------------------
+int CEventWriter::LookupNameId(CUtlDict<int, int>& ids, int selectStatement, int insertStatement, const char* name)
+{
+    int index = ids.Find(name);
+    if (index != ids.InvalidIndex())
+        return ids[index];
+
+    // Another server sharing the database can insert the same name between our
+    // SELECT and INSERT; the INSERT then fails on the UNIQUE constraint and the
+    // SELECT is tried once more.
+    const char* const values[] = { name };
+    int id = 0;
+    for (int attempt = 0; attempt < 2 && id == 0; attempt++)
+    {
+        PGresult* res = m_Statements.Exec(m_db, selectStatement, values, NULL, NULL);
+        if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+            id = atoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        if (id != 0 || PQstatus(m_db) != CONNECTION_OK)
+            break;
+
+        res = m_Statements.Exec(m_db, insertStatement, values, NULL, NULL);
+        if (PQresultStatus(res) == PGRES_TUPLES_OK)
+            id = atoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+    }
+
+    if (id == 0)
+    {
+        Warning("Looking up the id of \"%s\" failed: %s", name, PQerrorMessage(m_db));
+        return 0;
+    }
+
+    ids.Insert(name, id);
+    return id;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: preloads a name dictionary when connecting, so that a restarted
+//          server doesn't look its names up one at a time
+//---------------------------------------------------------------------------------
+void CEventWriter::LoadNameIds(CUtlDict<int, int>& ids, int statement)
+{
+    PGresult* res = m_Statements.Exec(m_db, statement, NULL, NULL, NULL);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK)
+    {
+        for (int i = 0; i < PQntuples(res); i++)
+        {
+            const char* name = PQgetvalue(res, i, 1);
+            if (ids.Find(name) == ids.InvalidIndex())
+                ids.Insert(name, atoi(PQgetvalue(res, i, 0)));
+        }
+    }
+    else
+    {
+        Warning("Loading event names failed: %s", PQerrorMessage(m_db));
+    }
+    PQclear(res);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: appends a string to a COPY text-format row, escaping the characters
+//          that COPY treats specially
+//---------------------------------------------------------------------------------
+static void CopyPutText(CUtlBuffer& buf, const char* value, int len)
+{
+    const char* start = value;
+    const char* end = value + len;
+    for (const char* p = value; p != end; p++)
+    {
+        char escape;
+        switch (*p)
+        {
+        case '\\': escape = '\\'; break;
+        case '\t': escape = 't'; break;
+        case '\n': escape = 'n'; break;
+        case '\r': escape = 'r'; break;
+        default: continue;
+        }
+        buf.Put(start, p - start);
+        buf.PutChar('\\');
+        buf.PutChar(escape);
+        start = p + 1;
+    }
+    buf.Put(start, end - start);
+}
+
+static void CopyPutFormat(CUtlBuffer& buf, const char* fmt, ...)
+{
+    char str[64];
+    va_list args;
+    va_start(args, fmt);
+    int len = Q_vsnprintf(str, sizeof(str), fmt, args);
+    va_end(args);
+    buf.Put(str, len);
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: puts the columns Event and the ev_* tables have in common, Id (or
+//          EventId), GameSessionId, DateTime, Tick, CurTimeMs, MonotonicUs and
+//          Seq, without a trailing tab
+//---------------------------------------------------------------------------------
+void CEventWriter::CopyPutEventColumns(int id, const CEventRecord* pRecord)
+{
+    CopyPutFormat(m_CopyBuffer, "%d\t", id);
+    if (pRecord->GetGameSessionId() == m_gameSessionId)
+        m_CopyBuffer.Put(m_szGameSessionId, m_nGameSessionIdLength);
+    else
+        CopyPutFormat(m_CopyBuffer, "%d", pRecord->GetGameSessionId());
+
+    char timestamp[TIMESTAMP_TEXT_SIZE];
+    const EventTime_t& time = pRecord->GetTime();
+    m_CopyBuffer.PutChar('\t');
+    m_CopyBuffer.Put(timestamp, FormatTimestamp(timestamp, time.m_ulWallClock));
+    CopyPutFormat(m_CopyBuffer, "\t%d\t%d\t%llu", time.m_iTick, time.m_iCurTime, (unsigned long long)time.m_ulMonotonic);
+    if (pRecord->GetSeq() != 0)
+        CopyPutFormat(m_CopyBuffer, "\t%llu", (unsigned long long)pRecord->GetSeq());
+    else
+        CopyPutFormat(m_CopyBuffer, "\t\\N");
+}
+
+static void JsonPutString(CUtlBuffer& buf, const char* value, int len)
+{
+    buf.PutChar('"');
+    const char* start = value;
+    const char* end = value + len;
+    for (const char* p = value; p != end; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        if (c != '"' && c != '\\' && c >= 0x20)
+            continue;
+
+        buf.Put(start, p - start);
+        if (c == '"' || c == '\\')
+        {
+            buf.PutChar('\\');
+            buf.PutChar(c);
+        }
+        else
+        {
+            CopyPutFormat(buf, "\\u%04x", c);
+        }
+        start = p + 1;
+    }
+    buf.Put(start, end - start);
+    buf.PutChar('"');
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: encodes an event's keys as a NUL-terminated JSON object, keeping
+//          ints and floats as JSON numbers
+//---------------------------------------------------------------------------------
+static void PutEventJson(CUtlBuffer& buf, const CEventRecord* pRecord)
+{
+    buf.PutChar('{');
+    for (int i = 0; i < pRecord->GetKeyCount(); i++)
+    {
+        const EventRecordKey_t& key = pRecord->GetKey(i);
+        if (i != 0)
+            buf.PutChar(',');
+        const char* name = pRecord->GetKeyName(i);
+        JsonPutString(buf, name, strlen(name));
+        buf.PutChar(':');
+        switch (key.m_Type)
+        {
+        case KeyValues::TYPE_STRING:
+            JsonPutString(buf, key.m_pszValue, key.m_nLength);
+            break;
+        case KeyValues::TYPE_INT:
+            CopyPutFormat(buf, "%d", key.m_iValue);
+            break;
+        case KeyValues::TYPE_FLOAT:
+            // JSON has no NaN or infinity
+            if (IsFinite(key.m_flValue))
+                CopyPutFormat(buf, "%.9g", key.m_flValue);
+            else
+                CopyPutFormat(buf, "null");
+            break;
+        case KeyValues::TYPE_UINT64:
+            CopyPutFormat(buf, "%llu", (unsigned long long)key.m_ulValue);
+            break;
+        default:
+            CopyPutFormat(buf, "null");
+            break;
+        }
+    }
+    buf.PutChar('}');
+    buf.PutChar('\0');
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes a range of the batch with one COPY into Event and one into
+//          EventData, in a single transaction
+//---------------------------------------------------------------------------------
+bool CEventWriter::CopyEvents(int first, int count)
+{
+    if (!ExecCommand("BEGIN TRANSACTION"))
+        return false;
+
+    if (!CopyNarrowEvents(first, count))
+    {
+        ExecCommand("ROLLBACK TRANSACTION");
+        return false;
+    }
+    return ExecCommand("COMMIT TRANSACTION");
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: copies the events in a range of the batch that IsNarrowEvent into
+//          Event, and EventData unless they are stored as JSON, inside the
+//          caller's transaction
+//---------------------------------------------------------------------------------
+bool CEventWriter::CopyNarrowEvents(int first, int count)
+{
+    bool bJson = (m_BatchStorage == STORAGE_JSON);
+
+    char timestamp[TIMESTAMP_TEXT_SIZE];
+    m_CopyBuffer.Clear();
+    for (int i = first; i < first + count; i++)
+    {
+        if (!IsNarrowEvent(i))
+            continue;
+
+        CopyPutEventColumns(m_BatchIds[i], m_Batch[i]);
+        CopyPutFormat(m_CopyBuffer, "\t%d", m_Batch[i]->GetTypeId());
+        if (bJson)
+        {
+            m_JsonBuffer.Clear();
+            PutEventJson(m_JsonBuffer, m_Batch[i]);
+            m_CopyBuffer.PutChar('\t');
+            CopyPutText(m_CopyBuffer, (const char*)m_JsonBuffer.Base(), m_JsonBuffer.TellPut() - 1);
+        }
+        m_CopyBuffer.PutChar('\n');
+    }
+    if (m_CopyBuffer.TellPut() == 0)
+        return true;
+
+    bool success = Copy("event", bJson ?
+        "Id, GameSessionId, DateTime, Tick, CurTimeMs, MonotonicUs, Seq, EventTypeId, Data" :
+        "Id, GameSessionId, DateTime, Tick, CurTimeMs, MonotonicUs, Seq, EventTypeId");
+
+    if (success && !bJson)
+    {
+        m_CopyBuffer.Clear();
+        for (int i = first; i < first + count; i++)
+        {
+            if (!IsNarrowEvent(i))
+                continue;
+
+            const CEventRecord* pRecord = m_Batch[i];
+            int timestampLength = FormatTimestamp(timestamp, pRecord->GetTime().m_ulWallClock);
+            for (int j = 0; j < pRecord->GetKeyCount(); j++)
+            {
+                const EventRecordKey_t& key = pRecord->GetKey(j);
+
+                CopyPutFormat(m_CopyBuffer, "%d\t%d\t", m_BatchIds[i], key.m_iKeyId);
+                m_CopyBuffer.Put(timestamp, timestampLength);
+                switch (key.m_Type)
+                {
+                case KeyValues::TYPE_STRING:
+                    m_CopyBuffer.PutChar('\t');
+                    CopyPutText(m_CopyBuffer, key.m_pszValue, key.m_nLength);
+                    CopyPutFormat(m_CopyBuffer, "\t\\N\t\\N\t\\N\n");
+                    break;
+                case KeyValues::TYPE_INT:
+                    CopyPutFormat(m_CopyBuffer, "\t\\N\t%d\t\\N\t\\N\n", key.m_iValue);
+                    break;
+                case KeyValues::TYPE_FLOAT:
+                    // %.9g round-trips every float exactly
+                    CopyPutFormat(m_CopyBuffer, "\t\\N\t\\N\t%.9g\t\\N\n", key.m_flValue);
+                    break;
+                case KeyValues::TYPE_UINT64:
+                    CopyPutFormat(m_CopyBuffer, "\t\\N\t\\N\t\\N\t%llu\n", (unsigned long long)key.m_ulValue);
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+        if (m_CopyBuffer.TellPut() != 0)
+            success = Copy("eventdata", "EventId, KeyId, DateTime, ValueString, ValueInt, ValueFloat, ValueBigInt");
+    }
+    return success;
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes a range of the batch with INSERTs, in a single transaction
+//---------------------------------------------------------------------------------
+bool CEventWriter::InsertEvents(int first, int count)
+{
+    if (!ExecCommand("BEGIN TRANSACTION"))
+        return false;
+
+    for (int i = first; i < first + count; i++)
+    {
+        if (!InsertEvent(m_Batch[i], m_BatchIds[i]))
+        {
+            ExecCommand("ROLLBACK TRANSACTION");
+            return false;
+        }
+    }
+
+    return ExecCommand("COMMIT TRANSACTION");
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: writes a range of the batch with one COPY per event table, in a
+//          single transaction
+//---------------------------------------------------------------------------------
+bool CEventWriter::CopyWideEvents(int first, int count)
+{
+    if (!ExecCommand("BEGIN TRANSACTION"))
+        return false;
+
+    bool success = true;
+    for (int i = first; i < first + count && success; i++)
+    {
+        // Each table's rows are sent together when its first event comes up
+        int table = m_BatchTables[i];
+        if (table < 0)
+            continue;
+        bool bSent = false;
+        for (int j = first; j < i && !bSent; j++)
+            bSent = (m_BatchTables[j] == table);
+        if (bSent)
+            continue;
+
+        const EventTable_t& eventTable = m_Tables.GetTable(table);
+        m_CopyBuffer.Clear();
+        for (int j = i; j < first + count; j++)
+        {
+            if (m_BatchTables[j] != table)
+                continue;
+
+            const CEventRecord* pRecord = m_Batch[j];
+            CopyPutEventColumns(m_BatchIds[j], pRecord);
+            for (int k = 0; k < eventTable.m_Columns.Count(); k++)
+            {
+                int key = CEventTables::FindKey(pRecord, eventTable.m_Columns[k]);
+                if (key < 0)
+                {
+                    CopyPutFormat(m_CopyBuffer, "\t\\N");
+                    continue;
+                }
+
+                // A value of another type than the column's would fail the
+                // whole COPY, so it is converted, or left NULL if it can't be
+                const EventColumn_t& column = eventTable.m_Columns[k];
+                const EventRecordKey_t& value = pRecord->GetKey(key);
+                if (value.m_Type != column.m_Type)
+                {
+                    char converted[64];
+                    if (CEventTables::ConvertValue(value, column.m_Type, converted, sizeof(converted)))
+                    {
+                        CopyPutFormat(m_CopyBuffer, "\t%s", converted);
+                    }
+                    else
+                    {
+                        if (!column.m_bWarnedType)
+                            Warning("Writing NULL for %s values of %s that don't fit column %s.%s\n", pRecord->GetKeyName(key), pRecord->GetName(), eventTable.m_szTable, column.m_pszColumn);
+                        column.m_bWarnedType = true;
+                        CopyPutFormat(m_CopyBuffer, "\t\\N");
+                    }
+                    continue;
+                }
+
+                switch (value.m_Type)
+                {
+                case KeyValues::TYPE_STRING:
+                    m_CopyBuffer.PutChar('\t');
+                    CopyPutText(m_CopyBuffer, value.m_pszValue, value.m_nLength);
+                    break;
+                case KeyValues::TYPE_INT:
+                    CopyPutFormat(m_CopyBuffer, "\t%d", value.m_iValue);
+                    break;
+                case KeyValues::TYPE_FLOAT:
+                    CopyPutFormat(m_CopyBuffer, "\t%.9g", value.m_flValue);
+                    break;
+                case KeyValues::TYPE_UINT64:
+                    CopyPutFormat(m_CopyBuffer, "\t%llu", (unsigned long long)value.m_ulValue);
+                    break;
+                default:
+                    CopyPutFormat(m_CopyBuffer, "\t\\N");
+                    break;
+                }
+            }
+            m_CopyBuffer.PutChar('\n');
+        }
+        success = Copy(eventTable.m_szTable, eventTable.m_pszCopyColumns);
+    }
+
+    // Events whose table couldn't be prepared
+    if (success)
+        success = CopyNarrowEvents(first, count);
+
+    if (!success)
+    {
+        ExecCommand("ROLLBACK TRANSACTION");
+        return false;
+    }
+    return ExecCommand("COMMIT TRANSACTION");
+}
+
+static void PutSql(CUtlBuffer& buf, const char* str)
+{
+    buf.Put(str, strlen(str));
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: copies m_CopyBuffer into columns of table.
+//
+//          A batch being written again may be partly in the database already,
+//          and a plain COPY would fail on the rows that are.  So its rows are
+//          copied to a temporary table instead and merged in with INSERT ...
+//          ON CONFLICT DO NOTHING, which skips those rows by their keys.  An
+//          event's keys are the same each time it is written, as it keeps its
+//          Event.Id, GameSessionId, Seq and DateTime.
+//---------------------------------------------------------------------------------
+bool CEventWriter::Copy(const char* table, const char* columns)
+{
+    const char* target = table;
+    if (m_bBatchResend)
+    {
+        m_SqlBuffer.Clear();
+        PutSql(m_SqlBuffer, "CREATE TEMP TABLE resend (LIKE \"");
+        PutSql(m_SqlBuffer, table);
+        PutSql(m_SqlBuffer, "\") ON COMMIT DROP");
+        m_SqlBuffer.PutChar('\0');
+        if (!ExecCommand((const char*)m_SqlBuffer.Base()))
+            return false;
+        target = "resend";
+    }
+
+    m_SqlBuffer.Clear();
+    PutSql(m_SqlBuffer, "COPY \"");
+    PutSql(m_SqlBuffer, target);
+    PutSql(m_SqlBuffer, "\" (");
+    PutSql(m_SqlBuffer, columns);
+    PutSql(m_SqlBuffer, ") FROM STDIN");
+    m_SqlBuffer.PutChar('\0');
+
+    PGresult* res = PQexec(m_db, (const char*)m_SqlBuffer.Base());
+    ExecStatusType resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COPY_IN)
+    {
+        Warning("\"COPY %s\" failed: %s", table, PQerrorMessage(m_db));
+        return false;
+    }
+
+    bool success = PQputCopyData(m_db, (const char*)m_CopyBuffer.Base(), m_CopyBuffer.TellPut()) == 1;
+    if (PQputCopyEnd(m_db, success ? NULL : "failed to send COPY data") != 1)
+        success = false;
+
+    while ((res = PQgetResult(m_db)) != NULL)
+    {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+            success = false;
+        PQclear(res);
+    }
+
+    if (!success)
+    {
+        Warning("\"COPY %s\" failed: %s", table, PQerrorMessage(m_db));
+        return false;
+    }
+
+    if (m_bBatchResend)
+    {
+        m_SqlBuffer.Clear();
+        PutSql(m_SqlBuffer, "INSERT INTO \"");
+        PutSql(m_SqlBuffer, table);
+        PutSql(m_SqlBuffer, "\" (");
+        PutSql(m_SqlBuffer, columns);
+        PutSql(m_SqlBuffer, ") SELECT ");
+        PutSql(m_SqlBuffer, columns);
+        PutSql(m_SqlBuffer, " FROM resend ON CONFLICT DO NOTHING");
+        m_SqlBuffer.PutChar('\0');
+        success = ExecCommand((const char*)m_SqlBuffer.Base()) && ExecCommand("DROP TABLE resend");
+    }
+    return success;
+}
+
+bool CEventWriter::InsertEvent(const CEventRecord* pRecord, int id)
+{
+    // Ints and floats are sent in binary (network byte order) so nothing is
+    // lost to formatting and the server doesn't have to parse them back.
+    char eventId[4];
+    EncodeInt4(eventId, id);
+
+    // Events being written again may belong to an earlier GameSession
+    char gameSessionIdValue[4];
+    const char* gameSessionId = m_GameSessionIdBinary;
+    if (pRecord->GetGameSessionId() != m_gameSessionId)
+    {
+        EncodeInt4(gameSessionIdValue, pRecord->GetGameSessionId());
+        gameSessionId = gameSessionIdValue;
+    }
+
+    // EventData rows share the Event row's DateTime, which decides their partition
+    const EventTime_t& time = pRecord->GetTime();
+    char dateTime[8];
+    EncodeTimestamp(dateTime, time.m_ulWallClock);
+
+    PGresult* res;
+    {
+        char typeId[4];
+        EncodeInt4(typeId, pRecord->GetTypeId());
+        char tick[4];
+        EncodeInt4(tick, time.m_iTick);
+        char curTime[4];
+        EncodeInt4(curTime, time.m_iCurTime);
+        char monotonic[8];
+        EncodeInt8(monotonic, time.m_ulMonotonic);
+        char seqValue[8];
+        EncodeInt8(seqValue, pRecord->GetSeq());
+        const char* seq = pRecord->GetSeq() != 0 ? seqValue : NULL;
+
+        if (m_BatchStorage == STORAGE_JSON)
+        {
+            m_JsonBuffer.Clear();
+            PutEventJson(m_JsonBuffer, pRecord);
+
+            const char* const values[] = { eventId, gameSessionId, typeId, dateTime, tick, curTime, monotonic, seq, (const char*)m_JsonBuffer.Base() };
+            const int lengths[] = { sizeof(eventId), sizeof(m_GameSessionIdBinary), sizeof(typeId), sizeof(dateTime), sizeof(tick), sizeof(curTime), sizeof(monotonic), sizeof(seqValue), 0 };
+            const int paramFormats[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0 };
+            res = m_Statements.Exec(m_db, STMT_INSERT_EVENT_JSON, values, lengths, paramFormats);
+        }
+        else
+        {
+            const char* const values[] = { eventId, gameSessionId, typeId, dateTime, tick, curTime, monotonic, seq };
+            const int lengths[] = { sizeof(eventId), sizeof(m_GameSessionIdBinary), sizeof(typeId), sizeof(dateTime), sizeof(tick), sizeof(curTime), sizeof(monotonic), sizeof(seqValue) };
+            const int paramFormats[] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+            res = m_Statements.Exec(m_db, STMT_INSERT_EVENT, values, lengths, paramFormats);
+        }
+        ExecStatusType resStatus = PQresultStatus(res);
+        PQclear(res);
+        if (resStatus != PGRES_COMMAND_OK)
+        {
+            Warning("\"INSERT INTO Event\" failed: %s\n", PQerrorMessage(m_db));
+            return false;
+        }
+    }
+
+    // In JSON mode the keys went in Event.Data
+    if (m_BatchStorage == STORAGE_JSON)
+        return true;
+
+    for (int i = 0; i < pRecord->GetKeyCount(); i++)
+    {
+        const EventRecordKey_t& key = pRecord->GetKey(i);
+        char keyId[4];
+        EncodeInt4(keyId, key.m_iKeyId);
+
+        switch (key.m_Type)
+        {
+        case KeyValues::TYPE_STRING:
+            {
+                const char* keyValue = key.m_pszValue;
+
+                const char* const values[] = { eventId, keyId, dateTime, keyValue };
+                const int lengths[] = { sizeof(eventId), sizeof(keyId), sizeof(dateTime), key.m_nLength };
+                const int paramFormats[] = { 1, 1, 1, 0 };
+                res = m_Statements.Exec(m_db, STMT_INSERT_EVENTDATA_STRING, values, lengths, paramFormats);
+                ExecStatusType resStatus = PQresultStatus(res);
+                PQclear(res);
+                if (resStatus != PGRES_COMMAND_OK)
+                {
+                    Warning("\"INSERT INTO EventData\" for string data failed: %s\n", PQerrorMessage(m_db));
+                    return false;
+                }
+            }
+            break;
+        case KeyValues::TYPE_INT:
+            {
+                char keyValue[4];
+                EncodeInt4(keyValue, key.m_iValue);
+
+                const char* const values[] = { eventId, keyId, dateTime, keyValue };
+                const int lengths[] = { sizeof(eventId), sizeof(keyId), sizeof(dateTime), sizeof(keyValue) };
+                const int paramFormats[] = { 1, 1, 1, 1 };
+                res = m_Statements.Exec(m_db, STMT_INSERT_EVENTDATA_INT, values, lengths, paramFormats);
+                ExecStatusType resStatus = PQresultStatus(res);
+                PQclear(res);
+                if (resStatus != PGRES_COMMAND_OK)
+                {
+                    Warning("\"INSERT INTO EventData\" for int data failed: %s\n", PQerrorMessage(m_db));
+                    return false;
+                }
+            }
+            break;
+        case KeyValues::TYPE_FLOAT:
+            {
+                char keyValue[8];
+                EncodeFloat8(keyValue, key.m_flValue);
+
+                const char* const values[] = { eventId, keyId, dateTime, keyValue };
+                const int lengths[] = { sizeof(eventId), sizeof(keyId), sizeof(dateTime), sizeof(keyValue) };
+                const int paramFormats[] = { 1, 1, 1, 1 };
+                res = m_Statements.Exec(m_db, STMT_INSERT_EVENTDATA_FLOAT, values, lengths, paramFormats);
+                ExecStatusType resStatus = PQresultStatus(res);
+                PQclear(res);
+                if (resStatus != PGRES_COMMAND_OK)
+                {
+                    Warning("\"INSERT INTO EventData\" for float data failed: %s\n", PQerrorMessage(m_db));
+                    return false;
+                }
+            }
+            break;
+        case KeyValues::TYPE_UINT64:
+            {
+                char keyValue[8];
+                EncodeInt8(keyValue, key.m_ulValue);
+
+                const char* const values[] = { eventId, keyId, dateTime, keyValue };
+                const int lengths[] = { sizeof(eventId), sizeof(keyId), sizeof(dateTime), sizeof(keyValue) };
+                const int paramFormats[] = { 1, 1, 1, 1 };
+                res = m_Statements.Exec(m_db, STMT_INSERT_EVENTDATA_BIGINT, values, lengths, paramFormats);
+                ExecStatusType resStatus = PQresultStatus(res);
+                PQclear(res);
+                if (resStatus != PGRES_COMMAND_OK)
+                {
+                    Warning("\"INSERT INTO EventData\" for bigint data failed: %s\n", PQerrorMessage(m_db));
+                    return false;
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
@@ -0,0 +1,222 @@
+//===========================================================================//
+//
+// Purpose: background thread that owns the stats database connection and
+//          writes captured events, so that the game thread never waits on
+//          PostgreSQL.
+//
+//===========================================================================//
+
+#ifndef EVENTWRITER_H
+#define EVENTWRITER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/threadtools.h"
+#include "tier0/tslist.h"
+#include "utlbuffer.h"
+#include "utldict.h"
+#include "utlmap.h"
+#include "utlvector.h"
+#include "vstdlib/IKeyValuesSystem.h"
+
+#include "EventArena.h"
+#include "EventPartitions.h"
+#include "EventSpool.h"
+#include "EventTables.h"
+#include "PreparedStatements.h"
+
+#include "libpq-fe.h"
+
+class CEventRecord;
+class CEventRecordBuilder;
+class CEventDescriptors;
+
+#define KEY_SYMBOL_CACHE_SIZE 1024     // must be a power of two
+
+class CEventWriter
+{
+public:
+    CEventWriter();
+    ~CEventWriter();
+
+    // Reads the game's event descriptions for eventlogger_storage "wide".  Must be
+    // called before Start.
+    void LoadEventDescriptors(const CEventDescriptors& descriptors);
+
+    // Starts the writer thread, which connects to the stats database in the
+    // background.  Events that can't be written are spooled to pszSpoolDirectory.
+    bool Start(const char* pszSpoolDirectory);
+
+    // Stops the writer thread.  Queued events are written for up to
+    // flDrainTimeout seconds; anything left after that is spooled, or discarded
+    // if the spool is disabled.
+    void Stop(float flDrainTimeout);
+
+    // Copies a captured event into the record arenas and hands it to the
+    // writer thread.  If the queue is full, eventlogger_queue_policy decides
+    // what is dropped.
+    void QueueEvent(const CEventRecordBuilder& event);
+
+    // For events held back before being queued: copies event into pArenas and
+    // numbers it in capture order, and later hands it to the writer thread.
+    CEventRecord* CaptureEvent(const CEventRecordBuilder& event, CEventArenas* pArenas);
+    void QueueRecord(CEventRecord* pRecord);
+
+    // Records a player's current name in the Player table.  Each player is
+    // written once per GameSession, and again only if their name changes.
+    void QueuePlayer(uint64 steamId, const char* pszName);
+
+    // Asks the writer thread to update the GameSession heartbeat.
+    void RequestHeartbeat();
+
+    // Returns true once for each new GameSession started by the writer thread.
+    bool CheckNewGameSession();
+
+    // Prints queue usage, dropped events, and call counts and timings of the
+    // writer's SQL statements.
+    void PrintStats();
+
+private:
+    static unsigned ThreadProc(void* pParam);
+    unsigned Run();
+
+    bool MakeRoom(const CEventRecord* pRecord);
+    void DropEvent(CEventRecord* pRecord);
+
+    unsigned GetWakeTimeout();
+    void UpdateConnection();
+    void StartConnect();
+    void PollConnect();
+    void ConnectFailed();
+    void FinishConnect();
+    void DatabaseDisconnect();
+    void Heartbeat();
+    void UpdatePlayers();
+    bool UpsertPlayer(uint64 steamId, const char* pszName, int nameLength);
+    void DrainQueue(int& discarded);
+    void FlushBatch();
+    void SpoolEvents(int first);
+    void ReplaySpool();
+    bool PrepareBatch();
+    bool AssignEventIds();
+    bool PrepareWideTables();
+    bool IsNarrowEvent(int i) const;
+    bool ResolveNameIds(bool bKeys);
+    int LookupKeyId(const CEventRecord* pRecord, int key);
+    int LookupNameId(CUtlDict<int, int>& ids, int selectStatement, int insertStatement, const char* name);
+    void LoadNameIds(CUtlDict<int, int>& ids, int statement);
+    int WriteEvents(int first, int count);
+    bool ExecCommand(const char* sql);
+    bool CopyEvents(int first, int count);
+    bool CopyNarrowEvents(int first, int count);
+    bool Copy(const char* table, const char* columns);
+    void CopyPutEventColumns(int id, const CEventRecord* pRecord);
+    bool InsertEvents(int first, int count);
+    bool InsertEvent(const CEventRecord* pRecord, int id);
+    void SetGameSessionId(int id);
+    bool CopyWideEvents(int first, int count);
+    int FormatTimestamp(char* out, uint64 wallClock);
+
+    ThreadHandle_t m_hThread;
+    CEventArenas m_Arenas;          // records in m_Queue and m_Batch are allocated from these
+    CTSQueue<CEventRecord*> m_Queue;
+
+    struct PlayerRecord_t
+    {
+        uint64 m_steamId;
+        int m_nNameLength;
+        char m_szName[128];
+    };
+    CTSQueue<PlayerRecord_t*> m_PlayerQueue;
+    CTSQueue<PlayerRecord_t*> m_FreePlayers;    // written records, for QueuePlayer to reuse
+    CThreadEvent m_WakeEvent;
+
+    // Set by the writer as it takes events off the queue, while the game
+    // thread is blocked waiting for room in it
+    CThreadEvent m_SpaceEvent;
+    volatile bool m_bWaitingForSpace;
+
+    // Only touched by the game thread
+    uint64 m_ulNextSeq;
+    int m_nQueuePeak;
+    bool m_bOverflowing;
+    CUtlDict<int, int> m_Dropped;
+
+    volatile bool m_bStopping;
+    volatile bool m_bHeartbeatRequested;
+    double m_flDrainDeadline;
+    double m_flBatchStart;
+    CInterlockedInt m_bNewGameSession;
+
+    // PQcancel is the one libpq call that is safe to make from another thread;
+    // Stop() uses it to abort a query that is still running past the deadline.
+    CThreadFastMutex m_CancelMutex;
+    PGcancel* m_pCancel;
+
+    // Only touched by the writer thread
+    enum ConnectState_t
+    {
+        DB_DISCONNECTED,
+        DB_CONNECTING,
+        DB_CONNECTED,
+    };
+    ConnectState_t m_ConnectState;
+    PostgresPollingStatusType m_PollStatus;
+    double m_flConnectStart;
+    double m_flNextConnect;
+    double m_flReconnectDelay;
+    PGconn* m_db;
+    int m_gameSessionId;
+
+    // m_gameSessionId encoded once per GameSession, as text for COPY and in
+    // binary for statement parameters
+    char m_szGameSessionId[12];
+    int m_nGameSessionIdLength;
+    char m_GameSessionIdBinary[4];
+
+    // The second FormatTimestamp last formatted, and its text
+    int64 m_nTimestampSecond;
+    char m_szTimestampSecond[24];
+    CPreparedStatements m_Statements;
+    CUtlVector<CEventRecord*> m_Batch;
+    CUtlVector<int> m_BatchIds;
+    CUtlVector<int> m_BatchTables;
+    int m_BatchStorage;             // StorageMode_t, fixed for each batch
+    bool m_bBatchResend;            // some of the batch has been written before
+    CEventTables m_Tables;
+    CEventPartitions m_Partitions;
+
+    // CRC of the name last written for each player this GameSession
+    CUtlMap<uint64, uint32> m_PlayerNames;
+    int m_nextEventId;
+    int m_eventIdsLeft;
+
+    // EventType and EventKey ids by name.  Ids never change once assigned, so
+    // these are kept across reconnects.
+    CUtlDict<int, int> m_EventTypeIds;
+    CUtlDict<int, int> m_EventKeyIds;
+
+    // Direct-mapped cache of EventKey ids by KeyValues symbol, checked before
+    // m_EventKeyIds so that most keys are resolved without touching their name
+    struct KeySymbolSlot_t
+    {
+        HKeySymbol m_Symbol;
+        int m_iKeyId;
+    };
+    KeySymbolSlot_t m_KeySymbolCache[KEY_SYMBOL_CACHE_SIZE];
+    CUtlBuffer m_CopyBuffer;
+    CUtlBuffer m_JsonBuffer;
+    CUtlBuffer m_SqlBuffer;
+
+    char m_szSpoolDirectory[260];
+    CEventSpool m_Spool;
+    bool m_bSpoolReady;
+
+    // Replays of the oldest spooled batch that failed while connected, and
+    // when to try it again
+    int m_nReplayFailures;
+    double m_flNextReplay;
+};
+
+#endif // EVENTWRITER_H
@@ -0,0 +1,191 @@
+//===========================================================================//
+//
+// Purpose: per-frame snapshot of player state
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PlayerSnapshots.h"
+#include "ClientRegistry.h"
+#include "EventRecord.h"
+#include "eiface.h"
+#include "edict.h"
+#include "iservernetworkable.h"
+#include "iserverunknown.h"
+#include "server_class.h"
+#include "dt_send.h"
+#include "game/server/iplayerinfo.h"
+#include "convar.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+extern IPlayerInfoManager* playerinfomanager;
+
+static ConVar eventlogger_enrich("eventlogger_enrich", "1", 0, "Add the team, class, health and position of the players an event's userid, attacker and assister keys refer to");
+
+// Event keys holding the userid of a player to describe
+static const char* s_UserIdKeys[] = { "userid", "attacker", "assister" };
+
+// Suffixes of the keys added for each of them; the order matches Enrich
+static const char* s_FieldSuffixes[] = { "team", "class", "health", "alive", "x", "y", "z" };
+
+CPlayerSnapshots::CPlayerSnapshots(CClientRegistry& clients)
+    : m_Clients(clients)
+{
+    m_bStale = true;
+    m_nPlayers = 0;
+    memset(m_UserIdSlot, 0, sizeof(m_UserIdSlot));
+    m_iClassOffset = 0;
+
+    // Symbols are looked up on first use, once the KeyValues system is loaded
+    for (int i = 0; i < ARRAYSIZE(m_UserIdKeys); i++)
+        m_UserIdKeys[i] = INVALID_KEY_SYMBOL;
+}
+
+const PlayerSnapshot_t* CPlayerSnapshots::Find(int userid)
+{
+    if (m_bStale)
+        Refresh();
+
+    int slot = m_UserIdSlot[userid & 0xFFFF];
+    if (slot == 0 || m_Players[slot - 1].m_iUserId != userid)
+        return NULL;
+    return &m_Players[slot - 1];
+}
+
+void CPlayerSnapshots::Refresh()
+{
+    m_bStale = false;
+
+    // Only clear the slots that were used rather than the whole table
+    for (int i = 0; i < m_nPlayers; i++)
+        m_UserIdSlot[m_Players[i].m_iUserId & 0xFFFF] = 0;
+    m_nPlayers = 0;
+
+    if (playerinfomanager == NULL)
+        return;
+
+    for (int i = 0; i < m_Clients.GetCount() && m_nPlayers < ARRAYSIZE(m_Players); i++)
+    {
+        edict_t* entity = m_Clients.Get(i).m_pEdict;
+        if (entity->IsFree())
+            continue;
+
+        IPlayerInfo* player = playerinfomanager->GetPlayerInfo(entity);
+        if (player == NULL || !player->IsConnected())
+            continue;
+
+        PlayerSnapshot_t& snapshot = m_Players[m_nPlayers];
+        snapshot.m_iUserId = player->GetUserID();
+        snapshot.m_iTeam = player->GetTeamIndex();
+        snapshot.m_iHealth = player->GetHealth();
+        snapshot.m_bAlive = !player->IsDead();
+        snapshot.m_vecOrigin = player->GetAbsOrigin();
+
+        snapshot.m_iClass = -1;
+        if (m_iClassOffset == 0)
+        {
+            m_iClassOffset = -1;
+            IServerNetworkable* networkable = entity->GetNetworkable();
+            if (networkable != NULL && networkable->GetServerClass() != NULL)
+                FindClassOffset(networkable->GetServerClass()->m_pTable);
+        }
+        if (m_iClassOffset > 0 && entity->GetUnknown() != NULL)
+        {
+            CBaseEntity* pEntity = entity->GetUnknown()->GetBaseEntity();
+            if (pEntity != NULL)
+                snapshot.m_iClass = *(int*)((char*)pEntity + m_iClassOffset);
+        }
+
+        m_UserIdSlot[snapshot.m_iUserId & 0xFFFF] = (unsigned char)(m_nPlayers + 1);
+        m_nPlayers++;
+    }
+}
+
+//---------------------------------------------------------------------------------
+// Purpose: finds m_PlayerClass.m_iClass in the player's send table.  Offsets of
+//          props in nested tables are relative to the table's own prop.
+//---------------------------------------------------------------------------------
+void CPlayerSnapshots::FindClassOffset(SendTable* pTable)
+{
+    for (int i = 0; i < pTable->GetNumProps(); i++)
+    {
+        SendProp* pProp = pTable->GetProp(i);
+        if (pProp->GetType() != DPT_DataTable || pProp->GetDataTable() == NULL)
+            continue;
+
+        if (Q_strcmp(pProp->GetName(), "m_PlayerClass") == 0)
+        {
+            SendTable* pClassTable = pProp->GetDataTable();
+            for (int j = 0; j < pClassTable->GetNumProps(); j++)
+            {
+                SendProp* pClassProp = pClassTable->GetProp(j);
+                if (pClassProp->GetType() == DPT_Int && Q_strcmp(pClassProp->GetName(), "m_iClass") == 0)
+                {
+                    m_iClassOffset = pProp->GetOffset() + pClassProp->GetOffset();
+                    return;
+                }
+            }
+        }
+        else if (pProp->GetOffset() == 0)
+        {
+            // Base class tables, such as DT_BasePlayer, share the entity's offsets
+            FindClassOffset(pProp->GetDataTable());
+            if (m_iClassOffset > 0)
+                return;
+        }
+    }
+}
+
+void CPlayerSnapshots::Enrich(CEventRecordBuilder& event)
+{
+    if (!eventlogger_enrich.GetBool())
+        return;
+
+    if (m_UserIdKeys[0] == INVALID_KEY_SYMBOL)
+    {
+        for (int i = 0; i < ARRAYSIZE(s_UserIdKeys); i++)
+        {
+            m_UserIdKeys[i] = KeyValuesSystem()->GetSymbolForString(s_UserIdKeys[i]);
+            for (int j = 0; j < ARRAYSIZE(s_FieldSuffixes); j++)
+            {
+                char name[64];
+                Q_snprintf(name, sizeof(name), "%s_%s", s_UserIdKeys[i], s_FieldSuffixes[j]);
+                m_FieldKeys[i][j] = KeyValuesSystem()->GetSymbolForString(name);
+            }
+        }
+    }
+
+    // Only the keys the game event came with are looked at, not the ones added here
+    int count = event.GetKeyCount();
+    for (int i = 0; i < count; i++)
+    {
+        const EventRecordKey_t& key = event.GetKey(i);
+        if (key.m_Type != KeyValues::TYPE_INT)
+            continue;
+
+        for (int j = 0; j < ARRAYSIZE(m_UserIdKeys); j++)
+        {
+            if (key.m_Symbol != m_UserIdKeys[j])
+                continue;
+
+            const PlayerSnapshot_t* snapshot = Find(key.m_iValue);
+            if (snapshot == NULL)
+                break;
+
+            const HKeySymbol* fields = m_FieldKeys[j];
+            event.AddInt(fields[0], snapshot->m_iTeam);
+            if (snapshot->m_iClass >= 0)
+                event.AddInt(fields[1], snapshot->m_iClass);
+            event.AddInt(fields[2], snapshot->m_iHealth);
+            event.AddInt(fields[3], snapshot->m_bAlive ? 1 : 0);
+            event.AddFloat(fields[4], snapshot->m_vecOrigin.x);
+            event.AddFloat(fields[5], snapshot->m_vecOrigin.y);
+            event.AddFloat(fields[6], snapshot->m_vecOrigin.z);
+            break;
+        }
+    }
+}
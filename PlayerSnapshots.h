@@ -0,0 +1,77 @@
+//===========================================================================//
+//
+// Purpose: a snapshot of every connected player's state, taken at most once
+//          per server frame, so that events which only carry userids (such
+//          as player_death) can be logged with the team, class, health and
+//          position of the players involved without calling into IPlayerInfo
+//          for every event.
+//
+//          Only the game thread uses this.
+//
+//===========================================================================//
+
+#ifndef PLAYERSNAPSHOTS_H
+#define PLAYERSNAPSHOTS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "const.h"
+#include "mathlib/vector.h"
+#include "vstdlib/IKeyValuesSystem.h"
+
+class CClientRegistry;
+class CEventRecordBuilder;
+class SendTable;
+
+struct PlayerSnapshot_t
+{
+    int m_iUserId;
+    int m_iTeam;
+    int m_iClass;                   // TF2 player class, or -1 if the mod has none
+    int m_iHealth;
+    bool m_bAlive;
+    Vector m_vecOrigin;
+};
+
+class CPlayerSnapshots
+{
+public:
+    CPlayerSnapshots(CClientRegistry& clients);
+
+    // Marks the snapshot out of date; call once per GameFrame and whenever
+    // entities may have gone away, eg. at LevelShutdown.  The snapshot is
+    // retaken the next time a player is looked up.
+    void Invalidate() { m_bStale = true; }
+
+    // Returns the state of the player with userid at the start of this
+    // frame, or NULL if there is no such player.
+    const PlayerSnapshot_t* Find(int userid);
+
+    // Adds <key>_team, <key>_class, <key>_health, <key>_alive and
+    // <key>_x/_y/_z for each of event's userid, attacker and assister keys
+    // that refers to a player in the snapshot.
+    void Enrich(CEventRecordBuilder& event);
+
+private:
+    void Refresh();
+    void FindClassOffset(SendTable* pTable);
+
+    CClientRegistry& m_Clients;
+    bool m_bStale;
+    int m_nPlayers;
+    PlayerSnapshot_t m_Players[ABSOLUTE_PLAYER_LIMIT];
+
+    // m_Players index + 1 for each userid, or 0.  Userids are networked as
+    // shorts, so this covers all of them.
+    unsigned char m_UserIdSlot[0x10000];
+
+    // Offset of CTFPlayer::m_PlayerClass.m_iClass from the entity, found from
+    // its send table: 0 before the first lookup, -1 if the mod hasn't got one
+    int m_iClassOffset;
+
+    HKeySymbol m_UserIdKeys[3];
+    HKeySymbol m_FieldKeys[3][7];
+};
+
+#endif // PLAYERSNAPSHOTS_H
@@ -0,0 +1,99 @@
+//===========================================================================//
+//
+// Purpose: registry of prepared SQL statements
+//
+//===========================================================================//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PreparedStatements.h"
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// SQLSTATE returned when a prepared statement has gone away on the server,
+// eg. after a connection pooler ran DISCARD ALL
+#define SQLSTATE_INVALID_SQL_STATEMENT_NAME "26000"
+
+CPreparedStatements::CPreparedStatements(const PreparedStatement_t* pStatements, int count)
+{
+    m_pStatements = pStatements;
+    m_Stats.SetCount(count);
+    for (int i = 0; i < count; i++)
+    {
+        m_Stats[i].m_bPrepared = false;
+        m_Stats[i].m_nCalls = 0;
+        m_Stats[i].m_nFailures = 0;
+        m_Stats[i].m_flTotalTime = 0.0;
+    }
+}
+
+void CPreparedStatements::Reset()
+{
+    for (int i = 0; i < m_Stats.Count(); i++)
+        m_Stats[i].m_bPrepared = false;
+}
+
+bool CPreparedStatements::Prepare(PGconn* db, int statement)
+{
+    const PreparedStatement_t& stmt = m_pStatements[statement];
+
+    PGresult* res = PQprepare(db, stmt.m_pszName, stmt.m_pszSql, stmt.m_nParams, stmt.m_ParamTypes);
+    ExecStatusType resStatus = PQresultStatus(res);
+    PQclear(res);
+    if (resStatus != PGRES_COMMAND_OK)
+    {
+        Warning("Preparing \"%s\" failed: %s", stmt.m_pszSql, PQerrorMessage(db));
+        return false;
+    }
+
+    m_Stats[statement].m_bPrepared = true;
+    return true;
+}
+
+PGresult* CPreparedStatements::Exec(PGconn* db, int statement, const char* const* values, const int* lengths, const int* formats, int resultFormat)
+{
+    Assert(statement >= 0 && statement < m_Stats.Count());
+    StatementStats_t& stats = m_Stats[statement];
+    const char* name = m_pStatements[statement].m_pszName;
+
+    double start = Plat_FloatTime();
+
+    if (!stats.m_bPrepared)
+        Prepare(db, statement);
+
+    PGresult* res = PQexecPrepared(db, name, m_pStatements[statement].m_nParams, values, lengths, formats, resultFormat);
+
+    // If the server lost the statement, prepare it again and retry once
+    const char* sqlState = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (sqlState != NULL && strcmp(sqlState, SQLSTATE_INVALID_SQL_STATEMENT_NAME) == 0)
+    {
+        PQclear(res);
+        stats.m_bPrepared = false;
+        Prepare(db, statement);
+        res = PQexecPrepared(db, name, m_pStatements[statement].m_nParams, values, lengths, formats, resultFormat);
+    }
+
+    ExecStatusType resStatus = PQresultStatus(res);
+    if (resStatus != PGRES_COMMAND_OK && resStatus != PGRES_TUPLES_OK)
+        stats.m_nFailures++;
+
+    stats.m_nCalls++;
+    stats.m_flTotalTime += Plat_FloatTime() - start;
+    return res;
+}
+
+void CPreparedStatements::PrintStats()
+{
+    Msg("%-24s %10s %8s %12s %10s\n", "statement", "calls", "failed", "total ms", "avg ms");
+    for (int i = 0; i < m_Stats.Count(); i++)
+    {
+        const StatementStats_t& stats = m_Stats[i];
+        double totalMs = stats.m_flTotalTime * 1000.0;
+        Msg("%-24s %10d %8d %12.1f %10.3f\n", m_pStatements[i].m_pszName, stats.m_nCalls, stats.m_nFailures,
+            totalMs, stats.m_nCalls != 0 ? totalMs / stats.m_nCalls : 0.0);
+    }
+}
@@ -0,0 +1,101 @@
+//===========================================================================//
+//
+// Purpose: registry of the SQL statements the writer thread runs repeatedly.
+//          Each statement is prepared once per connection and then executed
+//          with PQexecPrepared, and calls to it are counted and timed.
+//
+//===========================================================================//
+
+#ifndef PREPAREDSTATEMENTS_H
+#define PREPAREDSTATEMENTS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "utlvector.h"
+
+#include "libpq-fe.h"
+
+#define PREPARED_STATEMENT_MAX_PARAMS 10
+
+struct PreparedStatement_t
+{
+    const char* m_pszName;
+    const char* m_pszSql;
+    int m_nParams;
+    Oid m_ParamTypes[PREPARED_STATEMENT_MAX_PARAMS];
+};
+
+// Binary-format (paramFormats = 1) encodings of int4, int8, float8 and timestamp
+// parameters, which PostgreSQL expects in network byte order.
+inline void EncodeInt4(char* out, int value)
+{
+    unsigned int u = (unsigned int)value;
+    out[0] = (char)(u >> 24);
+    out[1] = (char)(u >> 16);
+    out[2] = (char)(u >> 8);
+    out[3] = (char)u;
+}
+
+inline void EncodeInt8(char* out, uint64 value)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = (char)value;
+        value >>= 8;
+    }
+}
+
+inline void EncodeFloat8(char* out, double value)
+{
+    union { double d; uint64 u; } bits;
+    bits.d = value;
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = (char)bits.u;
+        bits.u >>= 8;
+    }
+}
+
+// A timestamp is int8 microseconds since 2000-01-01; wallClock is microseconds
+// since 1970-01-01.
+inline void EncodeTimestamp(char* out, uint64 wallClock)
+{
+    EncodeInt8(out, wallClock - (uint64)946684800 * 1000000);
+}
+
+class CPreparedStatements
+{
+public:
+    // pStatements is normally a static table and must outlive this object.
+    CPreparedStatements(const PreparedStatement_t* pStatements, int count);
+
+    // Forgets which statements have been prepared; call when the connection is closed.
+    void Reset();
+
+    // Runs a statement, preparing it first if this connection hasn't seen it yet.
+    // The caller owns the returned result and must PQclear it.
+    PGresult* Exec(PGconn* db, int statement, const char* const* values, const int* lengths, const int* formats, int resultFormat = 0);
+
+    // Prints call counts and cumulative time for each statement.  Called from
+    // the game thread while the writer may be updating them, so the numbers
+    // can be a call out of date.
+    void PrintStats();
+
+private:
+    bool Prepare(PGconn* db, int statement);
+
+    struct StatementStats_t
+    {
+        bool m_bPrepared;
+        int m_nCalls;
+        int m_nFailures;
+        double m_flTotalTime;
+    };
+
+    const PreparedStatement_t* m_pStatements;
+    CUtlVector<StatementStats_t> m_Stats;
+};
+
+#endif // PREPAREDSTATEMENTS_H
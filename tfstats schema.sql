@@ -3,18 +3,96 @@ CREATE TABLE GameSession (
   Heartbeat TIMESTAMP DEFAULT NOW() NOT NULL
 );
 
+-- Players are identified in events by their 64-bit SteamID (the "steamid"
+-- key).  Name is the one they used most recently; PlayerName keeps every
+-- name they have used.
+CREATE TABLE Player (
+  SteamId INT8 PRIMARY KEY,
+  Name TEXT NOT NULL,
+  FirstSeen TIMESTAMP DEFAULT NOW() NOT NULL,
+  LastSeen TIMESTAMP DEFAULT NOW() NOT NULL
+);
+
+CREATE TABLE PlayerName (
+  SteamId INT8 REFERENCES Player (SteamId) NOT NULL,
+  Name TEXT NOT NULL,
+  FirstSeen TIMESTAMP DEFAULT NOW() NOT NULL,
+  PRIMARY KEY (SteamId, Name)
+);
+
+-- Event names and keys are stored once here and referenced by id, rather
+-- than repeating the text on every Event and EventData row.
+CREATE TABLE EventType (
+  Id SERIAL PRIMARY KEY,
+  Name TEXT NOT NULL UNIQUE
+);
+
+CREATE TABLE EventKey (
+  Id SERIAL PRIMARY KEY,
+  Name TEXT NOT NULL UNIQUE
+);
+
+-- Event and EventData are partitioned on DateTime (PostgreSQL 11 or later).
+-- The plugin creates daily or weekly partitions ahead of time, see
+-- eventlogger_partition; rows outside them land in the default partitions.
+--
+-- Events are timestamped when they fire on the game server, not when they
+-- are written: DateTime is its wall clock in UTC, to the microsecond (the
+-- plugin runs its sessions with TimeZone UTC, so NOW() agrees), Tick and
+-- CurTimeMs are the server's tickcount and curtime, and MonotonicUs orders
+-- events from one server process even if its wall clock is stepped.
+--
+-- Seq numbers events in the order they were captured.  An event keeps its
+-- Id, GameSessionId, Seq and DateTime if it has to be written again, eg.
+-- after the connection dropped during COMMIT, so the copy is skipped rather
+-- than stored twice.
 CREATE TABLE Event (
-  Id SERIAL  PRIMARY KEY,
+  Id SERIAL,
   GameSessionId INT4 REFERENCES GameSession (Id) NOT NULL,
   DateTime TIMESTAMP DEFAULT NOW() NOT NULL,
-  Name TEXT NOT NULL
-);
+  EventTypeId INT4 REFERENCES EventType (Id) NOT NULL,
+  Tick INT4 NULL,
+  CurTimeMs INT4 NULL,
+  MonotonicUs INT8 NULL,
+  Seq INT8 NULL,
+  -- With eventlogger_storage "json", the event's keys instead of EventData
+  -- rows.  JSONB needs PostgreSQL 9.4 or later.
+  Data JSONB NULL,
+  PRIMARY KEY (Id, DateTime)
+) PARTITION BY RANGE (DateTime);
+
+CREATE TABLE Event_default PARTITION OF Event DEFAULT;
+
+CREATE INDEX Event_Data_idx ON Event USING GIN (Data);
+
+-- A unique index on a partitioned table has to include the partition key
+CREATE UNIQUE INDEX Event_Seq_idx ON Event (GameSessionId, Seq, DateTime);
+
+-- The plugin reserves Event ids in blocks; each nextval() hands it 1000 ids.
+-- Must match EVENT_ID_BLOCK_SIZE in EventWriter.cpp.
+ALTER SEQUENCE event_id_seq INCREMENT BY 1000;
 
+-- EventId can't be a foreign key, as Event.Id alone isn't unique across
+-- partitions.  DateTime is written with the Event row's, so an event's data
+-- lands in the matching partition.
 CREATE TABLE EventData (
-  EventId INT4 REFERENCES Event (Id) NOT NULL,
-  Key TEXT NOT NULL,
+  EventId INT4 NOT NULL,
+  KeyId INT4 REFERENCES EventKey (Id) NOT NULL,
+  DateTime TIMESTAMP DEFAULT NOW() NOT NULL,
   ValueString TEXT NULL,
   ValueInt INT4 NULL,
   ValueFloat FLOAT8 NULL,
-  PRIMARY KEY (EventId, Key)
-);
+  ValueBigInt INT8 NULL,
+  PRIMARY KEY (EventId, KeyId, DateTime)
+) PARTITION BY RANGE (DateTime);
+
+CREATE TABLE EventData_default PARTITION OF EventData DEFAULT;
+
+-- Event and EventData with their names joined back in, for ad hoc queries.
+CREATE VIEW EventNamed AS
+  SELECT Event.Id, Event.GameSessionId, Event.DateTime, Event.Tick, EventType.Name
+  FROM Event JOIN EventType ON EventType.Id = Event.EventTypeId;
+
+CREATE VIEW EventDataNamed AS
+  SELECT EventData.EventId, EventKey.Name AS Key, EventData.ValueString, EventData.ValueInt, EventData.ValueFloat, EventData.ValueBigInt
+  FROM EventData JOIN EventKey ON EventKey.Id = EventData.KeyId;